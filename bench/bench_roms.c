@@ -0,0 +1,144 @@
+#include "bench_roms.h"
+#include "string.h"
+
+// Emits bytes at the current position of the ROM being built
+static u8* rom;
+static size_t pos;
+static void emit(int n, const u8* bytes) {
+    memcpy(rom + pos, bytes, n);
+    pos += n;
+}
+#define EMIT(...) emit(sizeof((u8[]){__VA_ARGS__}), (u8[]){__VA_ARGS__})
+
+// Offset of a JR at the current position back to target
+#define BACK(target) (u8)((target) - (pos + 2))
+
+// Entry point and header, code starts at 0x150
+static void start(u8* data, u8 cart_type, u8 rom_size) {
+    rom = data;
+    pos = 0x100;
+    EMIT(0x00, 0xC3, 0x50, 0x01); // nop; jp 0x150
+    rom[0x147] = cart_type;
+    rom[0x148] = rom_size;
+    pos = 0x150;
+}
+
+// A tight loop of register, ALU, CB, memory, stack and branch instructions
+static void build_alu(u8* data) {
+    start(data, 0x00, 0x00);
+    EMIT(0x21, 0x00, 0xC0); // ld hl, 0xC000
+    size_t loop = pos;
+    EMIT(0x78, 0x81, 0x57, 0xAB, 0x1C, 0x0D); // ld a,b; add c; ld d,a; ...
+    EMIT(0xE6, 0x7F, 0xB4, 0xBD);             // and 0x7F; or h; cp l
+    EMIT(0xCB, 0x37, 0xCB, 0x10, 0xCB, 0x5A); // swap a; rl b; bit 3,d
+    EMIT(0x77, 0x7E, 0x2C);                   // ld [hl],a; ld a,[hl]; inc l
+    EMIT(0xC5, 0xC1);                         // push bc; pop bc
+    size_t call = pos;
+    EMIT(0xCD, 0x00, 0x00); // call sub
+    EMIT(0x18, BACK(loop));
+    rom[call + 1] = pos & 0xFF;
+    rom[call + 2] = pos >> 8;
+    EMIT(0xC9); // sub: ret
+}
+
+// Copies 4 KiB from one half of WRAM to the other, over and over
+static void build_memcpy(u8* data) {
+    start(data, 0x00, 0x00);
+    size_t outer = pos;
+    EMIT(0x21, 0x00, 0xC0); // ld hl, 0xC000
+    EMIT(0x11, 0x00, 0xD0); // ld de, 0xD000
+    EMIT(0x01, 0x00, 0x10); // ld bc, 0x1000
+    size_t inner = pos;
+    EMIT(0x2A, 0x12, 0x13); // ld a,[hl+]; ld [de],a; inc de
+    EMIT(0x0B, 0x78, 0xB1); // dec bc; ld a,b; or c
+    EMIT(0x20, BACK(inner));
+    EMIT(0x18, BACK(outer));
+}
+
+// Switches between the 7 banks of an MBC1 cartridge, summing 64 bytes of
+// each, so that bank switches are a large part of the work
+static void build_banks(u8* data) {
+    start(data, 0x01, 0x02); // MBC1, 128 KiB
+    for (size_t i = 0x4000; i < 0x20000; i++) {
+        rom[i] = (i >> 14) ^ i;
+    }
+    EMIT(0x06, 0x01); // ld b, 1
+    size_t outer = pos;
+    EMIT(0x78, 0xEA, 0x00, 0x20); // ld a,b; ld [0x2000],a
+    EMIT(0x21, 0x00, 0x40);       // ld hl, 0x4000
+    EMIT(0x0E, 0x40);             // ld c, 64
+    size_t sum = pos;
+    EMIT(0x86, 0x2C, 0x0D); // add [hl]; inc l; dec c
+    EMIT(0x20, BACK(sum));
+    EMIT(0xEA, 0x00, 0xC0);       // ld [0xC000],a
+    EMIT(0x04, 0x78, 0xE6, 0x07); // inc b; ld a,b; and 7
+    EMIT(0x20, 0x02, 0x06, 0x01); // jr nz, +2; ld b, 1
+    EMIT(0x18, BACK(outer));
+}
+
+// Shaped like a game: the main loop waits for VBlank with HALT and moves
+// sprites, the VBlank handler copies them to OAM and scrolls the background,
+// and two sound channels play throughout
+static void build_game(u8* data) {
+    start(data, 0x00, 0x00);
+
+    // VBlank handler
+    pos = 0x40;
+    EMIT(0xC3, 0x00, 0x02); // jp 0x200
+    pos = 0x200;
+    EMIT(0xF5, 0xC5, 0xD5, 0xE5); // push af; push bc; push de; push hl
+    EMIT(0x21, 0x00, 0xC1);       // ld hl, 0xC100
+    EMIT(0x11, 0x00, 0xFE);       // ld de, 0xFE00
+    EMIT(0x06, 0xA0);             // ld b, 160
+    size_t copy = pos;
+    EMIT(0x2A, 0x12, 0x1C, 0x05); // ld a,[hl+]; ld [de],a; inc e; dec b
+    EMIT(0x20, BACK(copy));
+    EMIT(0xF0, 0x43, 0x3C, 0xE0, 0x43); // scx++
+    EMIT(0xF0, 0x42, 0x3C, 0xE0, 0x42); // scy++
+    EMIT(0xE1, 0xD1, 0xC1, 0xF1); // pop hl; pop de; pop bc; pop af
+    EMIT(0xD9);                   // reti
+
+    pos = 0x150;
+    EMIT(0xF3);             // di
+    EMIT(0xAF, 0xE0, 0x40); // LCD off
+    // Tiles and the background map, 0x8000-0x9BFF, from a pattern
+    EMIT(0x21, 0x00, 0x80); // ld hl, 0x8000
+    size_t fill = pos;
+    EMIT(0x7D, 0xAC, 0x22);       // ld a,l; xor h; ld [hl+],a
+    EMIT(0x7C, 0xFE, 0x9C);       // ld a,h; cp 0x9C
+    EMIT(0x20, BACK(fill));
+    // 40 sprites spread over the screen
+    EMIT(0x21, 0x00, 0xC1); // ld hl, 0xC100
+    EMIT(0x06, 0x28);       // ld b, 40
+    size_t sprite = pos;
+    EMIT(0x78, 0x87, 0x87, 0x22); // ld a,b; add a; add a; ld [hl+],a (y)
+    EMIT(0x87, 0x22);             // add a; ld [hl+],a (x)
+    EMIT(0x78, 0x22, 0xAF, 0x22); // ld a,b; ld [hl+],a; xor a; ld [hl+],a
+    EMIT(0x05, 0x20, BACK(sprite));
+    // Palettes, then the LCD back on with the background and sprites
+    EMIT(0x3E, 0xE4, 0xE0, 0x47, 0xE0, 0x48);
+    EMIT(0x3E, 0x93, 0xE0, 0x40);
+    // Square wave on channel 2 and noise on channel 4, without lengths
+    EMIT(0x3E, 0x80, 0xE0, 0x16, 0x3E, 0xF0, 0xE0, 0x17);
+    EMIT(0x3E, 0x40, 0xE0, 0x18, 0x3E, 0x87, 0xE0, 0x19);
+    EMIT(0x3E, 0xA0, 0xE0, 0x21, 0x3E, 0x24, 0xE0, 0x22);
+    EMIT(0x3E, 0x80, 0xE0, 0x23);
+    // VBlank interrupt only
+    EMIT(0x3E, 0x01, 0xE0, 0xFF, 0xAF, 0xE0, 0x0F, 0xFB);
+
+    size_t main = pos;
+    EMIT(0x76, 0x00); // halt; nop
+    // Nudge every sprite's x along
+    EMIT(0x21, 0x01, 0xC1, 0x06, 0x28); // ld hl, 0xC101; ld b, 40
+    size_t move = pos;
+    EMIT(0x34, 0x2C, 0x2C, 0x2C, 0x2C); // inc [hl]; inc l (x4)
+    EMIT(0x05, 0x20, BACK(move));
+    EMIT(0x18, BACK(main));
+}
+
+const BenchRom bench_roms[BENCH_ROM_COUNT] = {
+    {"alu", 0x8000, build_alu},
+    {"memcpy", 0x8000, build_memcpy},
+    {"banks", 0x20000, build_banks},
+    {"game", 0x8000, build_game},
+};
@@ -0,0 +1,18 @@
+#ifndef RONDO_BENCH_ROMS_H
+#define RONDO_BENCH_ROMS_H
+
+#include "gb.h"
+
+// Synthetic ROMs for rondo-bench, each built in code so that the workloads
+// are the same wherever the benchmark is run
+typedef struct {
+    const char* name;
+    size_t size;
+    // Fills in a zeroed buffer of size bytes
+    void (*build)(u8* rom);
+} BenchRom;
+
+#define BENCH_ROM_COUNT 4
+extern const BenchRom bench_roms[BENCH_ROM_COUNT];
+
+#endif
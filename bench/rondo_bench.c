@@ -0,0 +1,179 @@
+// Runs the core headless on the synthetic ROMs in bench_roms.c, or on ROM
+// files given on the command line, as fast as it will go, and reports
+// emulated MHz, frames per second and nanoseconds per instruction.
+//
+// Usage: rondo-bench [--frames N] [--blocks] [--jit] [--mute] [rom...]
+#include "apu.h"
+#include "bench_roms.h"
+#include "block.h"
+#include "cpu.h"
+#include "jit.h"
+#include "profile.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+
+static int frames = 3000;
+static bool blocks;
+static bool jit;
+static bool mute;
+
+#define AUDIO_RATE 48000
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifndef RONDO_PROFILE
+// Whether run_opcode will execute an instruction, rather than wait in HALT
+// or start an interrupt
+static bool next_is_instruction(GameBoy* gb) {
+    if (gb->halted && !(gb->ie & gb->if_)) {
+        return false;
+    }
+    return !interrupt_pending(gb);
+}
+
+// Counts the instructions in the benchmarked frames by stepping a separate
+// instance through them. Every mode runs the same instructions, so this is
+// kept out of the timed run.
+static u64 count_instructions(u8* rom, size_t size) {
+    GameBoy* gb = make_gb(rom, size);
+    u64 count = 0;
+    for (int i = 0; i < frames; i++) {
+        while (!gb->end_frame) {
+            count += next_is_instruction(gb);
+            run_opcode(gb);
+        }
+        gb->end_frame = false;
+    }
+    destroy_gb(gb);
+    return count;
+}
+#endif
+
+// Times frames of the ROM and prints a row of results
+static bool bench(const char* name, u8* rom, size_t size) {
+    GameBoy* gb = make_gb(rom, size);
+    if (!gb) {
+        return false;
+    }
+    static u32 fbuf[SCREEN_WIDTH * SCREEN_HEIGHT];
+    gb->fbuf = fbuf;
+    if (blocks) {
+        enable_block_cache(gb);
+    }
+    if (jit && !enable_jit(gb)) {
+        printf("JIT not available in this build\n");
+        exit(1);
+    }
+    if (!mute) {
+        // Taken and thrown away every frame, as the frontend would
+        enable_audio(gb, AUDIO_RATE);
+    }
+
+#ifdef RONDO_PROFILE
+    u64 counted = profile_count();
+#endif
+    double start = now();
+    for (int i = 0; i < frames; i++) {
+        run_frame(gb);
+        apu_read_samples(gb, NULL, AUDIO_RATE);
+    }
+    double elapsed = now() - start;
+    u64 cycles = gb->cycles;
+    destroy_gb(gb);
+
+#ifdef RONDO_PROFILE
+    // Counting separately would add to the profile, and the profiler has
+    // counted them already
+    u64 instructions = profile_count() - counted;
+#else
+    u64 instructions = count_instructions(rom, size);
+#endif
+    printf("%-12s %8.1f %8.2f %9.3f %8.2f\n", name, frames / elapsed,
+           cycles / elapsed / 1e6, 1e3 * elapsed / frames,
+           instructions ? 1e9 * elapsed / instructions : 0);
+    return true;
+}
+
+static u8* load_file(const char* filename, size_t* size) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    u8* data = crit_alloc(*size);
+    if (fread(data, 1, *size, f) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+int main(int argc, char* argv[]) {
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--blocks")) {
+            blocks = true;
+        } else if (!strcmp(argv[i], "--jit")) {
+            jit = true;
+        } else if (!strcmp(argv[i], "--mute")) {
+            mute = true;
+        } else {
+            printf("Usage: rondo-bench [--frames N] [--blocks] [--jit] "
+                   "[--mute] [rom...]\n");
+            return 1;
+        }
+    }
+
+#ifdef RONDO_THREADED_DISPATCH
+    const char* dispatch = "threaded";
+#else
+    const char* dispatch = "function pointer";
+#endif
+    const char* mode = jit ? " with JIT" : blocks ? " with block cache" : "";
+    printf("%s dispatch%s, %d frames%s\n", dispatch, mode, frames,
+           mute ? ", no audio" : "");
+    printf("%-12s %8s %8s %9s %8s\n", "rom", "fps", "MHz", "ms/frame",
+           "ns/inst");
+
+    if (i == argc) {
+        for (int r = 0; r < BENCH_ROM_COUNT; r++) {
+            const BenchRom* b = &bench_roms[r];
+            u8* rom = crit_alloc(b->size);
+            b->build(rom);
+            bench(b->name, rom, b->size);
+            free(rom);
+        }
+    }
+
+    for (; i < argc; i++) {
+        size_t size;
+        u8* rom = load_file(argv[i], &size);
+        if (!rom) {
+            printf("Error: could not load file %s\n", argv[i]);
+            return 1;
+        }
+        // Just the file name, to keep the table narrow
+        const char* name = strrchr(argv[i], '/');
+        name = name ? name + 1 : argv[i];
+        if (!bench(name, rom, size)) {
+            printf("Failed to init %s\n", argv[i]);
+        }
+        free(rom);
+    }
+#ifdef RONDO_PROFILE
+    profile_write("rondo-profile");
+    printf("Profile written to rondo-profile.txt and rondo-profile.csv\n");
+#endif
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef RONDO_APU_H
+#define RONDO_APU_H
+
+#include "gb.h"
+
+// Sound registers and wave RAM (FF10-FF3F), addr is the low byte
+u8 apu_read(GameBoy* gb, u8 addr);
+void apu_write(GameBoy* gb, u8 addr, u8 data);
+
+// Runs the channels up to the present, producing any samples due
+void apu_sync(GameBoy* gb);
+
+// EVENT_APU handler, clocks the frame sequencer (512 Hz, off DIV)
+void apu_step(GameBoy* gb);
+
+// Called by timer.c after DIV is reset, edge being whether that cleared the
+// divider bit the sequencer is clocked by
+void apu_div_reset(GameBoy* gb, bool edge);
+
+// Starts mixing the channels into band-limited stereo samples at rate Hz.
+// Samples collect in gb until taken with apu_read_samples.
+void enable_audio(GameBoy* gb, u32 rate);
+void free_audio(GameBoy* gb);
+
+// Produces ratio times as many samples per emulated second as the rate given
+// to enable_audio, for the frontend to keep up with the host's audio clock
+void set_audio_ratio(GameBoy* gb, double ratio);
+
+// Brings the output level back in line with the channels, after their state
+// was changed other than by running them (rewinding, loading a state)
+void apu_resync(GameBoy* gb);
+
+// Moves up to max of the collected stereo frames (left then right) into dst,
+// or just drops them if dst is NULL. Returns how many there were.
+size_t apu_read_samples(GameBoy* gb, s16* dst, size_t max);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef RONDO_BLOCK_H
+#define RONDO_BLOCK_H
+
+#include "cpu.h"
+
+// Longest run of instructions decoded into a single block
+#define BLOCK_MAX_OPS 32
+
+// One pre-decoded instruction
+typedef struct {
+    // Entered with pc already past the opcode (and CB prefix, if any)
+    OpFuncPtr func;
+    // Immediate operand bytes, fed to the handler through read_imm_cycle
+    u8 imm[2];
+    // Bytes the opcode fetch accounts for (1, or 2 for CB opcodes)
+    u8 fetch;
+    // Total length in bytes
+    u8 length;
+} DecodedOp;
+
+typedef struct {
+    u16 pc;
+    // Host page the block was decoded from, identifies the ROM bank
+    u8* page;
+    bool valid;
+    u8 count;
+    DecodedOp ops[BLOCK_MAX_OPS];
+} Block;
+
+void enable_block_cache(GameBoy* gb);
+void free_block_cache(GameBoy* gb);
+
+// Decodes up to max instructions starting at pc into ops, stopping after a
+// control flow instruction or at the end of pc's page. Returns the count.
+int decode_block(GameBoy* gb, u16 pc, DecodedOp* ops, int max);
+
+// Runs the cached block at pc, or returns false if there isn't one
+bool run_block(GameBoy* gb);
+
+// Runs cached blocks (falling back to run_opcode) until the end of the frame
+void run_blocks(GameBoy* gb);
+
+// Called by write() for RAM pages that contain cached code
+void block_invalidate_page(GameBoy* gb, u16 addr);
+void block_drop_ram(GameBoy* gb);
+
+#endif
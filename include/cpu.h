@@ -3,6 +3,38 @@
 
 #include "gb.h"
 
+typedef void (*OpFuncPtr)(GameBoy*);
+
+extern const u8 op_lengths[256];
+extern const u8 op_cycles[256];
+
+OpFuncPtr op_handler(u8 opcode);
+OpFuncPtr cb_handler(u8 opcode);
+u8 cb_cycles(u8 opcode);
+
+static inline bool flag_z(GameBoy* gb) { return !gb->f_zres; }
+static inline bool flag_h(GameBoy* gb) { return gb->f_hres & 0x10; }
+static inline bool flag_c(GameBoy* gb) { return gb->f_cres & 0x100; }
+
+static inline void set_flags(GameBoy* gb, bool z, bool n, bool h, bool c) {
+    gb->f_zres = !z;
+    gb->f_n = n;
+    gb->f_hres = h << 4;
+    gb->f_cres = c << 8;
+}
+
+static inline bool interrupt_pending(GameBoy* gb) {
+    return gb->ime && (gb->ie & gb->if_);
+}
+
+// Whether the next step has to go through run_opcode rather than a faster
+// path: interrupts, HALT and the HALT bug are only handled there
+static inline bool needs_run_opcode(GameBoy* gb) {
+    return gb->halted || gb->halt_bug || interrupt_pending(gb);
+}
+
 void run_opcode(GameBoy* gb);
+// Runs instructions until the end of the current frame
+void run_opcodes(GameBoy* gb);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,15 @@
+#ifndef RONDO_DISASM_H
+#define RONDO_DISASM_H
+
+#include "gb.h"
+
+// Mnemonics of opcodes and CB opcodes, such as "LD A,n" or "JR NZ,e", with
+// immediates written as n (8-bit), nn (16-bit) or e (signed offset)
+const char* opcode_name(u8 opcode);
+const char* cb_opcode_name(u8 opcode);
+
+// Writes the instruction starting with bytes, found at pc, with its operands
+// filled in (JR targets as addresses). Returns its length in bytes.
+int disassemble(char* buf, size_t size, u16 pc, const u8 bytes[3]);
+
+#endif
@@ -2,6 +2,7 @@
 #define RONDO_GB_H
 
 #include "stdbool.h"
+#include "stddef.h"
 #include "stdint.h"
 
 #define RONDO_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
@@ -9,11 +10,18 @@
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 typedef int8_t s8;
 typedef int16_t s16;
 
 #define SCREEN_WIDTH 160
 #define SCREEN_HEIGHT 144
+// Bytes in the buffer fbuf points to, one 32-bit pixel from palette each
+#define FBUF_SIZE (SCREEN_WIDTH * SCREEN_HEIGHT * 4)
+// Rate of emulated time, gb->cycles counts these
+#define CYCLES_PER_SECOND 4194304
+// Length of a frame in T-cycles while the LCD is on
+#define CYCLES_PER_FRAME 70224
 
 // Macro to define CPU register pairs
 #if RONDO_BIG_ENDIAN
@@ -36,9 +44,55 @@ typedef int16_t s16;
 
 typedef enum { DMG, SGB, CGB } GBType;
 
+typedef enum { MBC_NONE, MBC1, MBC3, MBC5 } MbcType;
+
+// MBC3 clock registers, in the order they're selected from 0x08
+enum { RTC_S, RTC_M, RTC_H, RTC_DL, RTC_DH, RTC_COUNT };
+
+// Bits of gb->buttons, set while the button is held
+#define BUTTON_RIGHT (1 << 0)
+#define BUTTON_LEFT (1 << 1)
+#define BUTTON_UP (1 << 2)
+#define BUTTON_DOWN (1 << 3)
+#define BUTTON_A (1 << 4)
+#define BUTTON_B (1 << 5)
+#define BUTTON_SELECT (1 << 6)
+#define BUTTON_START (1 << 7)
+
+typedef struct BlockCache BlockCache;
+typedef struct JitCache JitCache;
+typedef struct RewindBuffer RewindBuffer;
+typedef struct AudioOut AudioOut;
+
+// Things that happen at a known point in emulated time, see schedule()
+typedef enum {
+    EVENT_LCD,
+    EVENT_SERIAL,
+    EVENT_TIMER,
+    EVENT_APU,
+    EVENT_COUNT
+} EventType;
+
+// Timestamp of an event that is not scheduled
+#define NEVER UINT64_MAX
+
+// What a sound channel is doing right now, its settings are read straight
+// from the registers in nr
+typedef struct {
+    bool on;      // Status bit in NR52
+    u16 length;   // Sequencer length clocks left before the channel stops
+    u8 volume;    // Envelope volume (0-15)
+    u8 env_timer; // Sequencer envelope clocks until the next volume step
+    u8 pos;       // Duty step (0-7) or wave sample (0-31)
+    u32 timer;    // T-cycles until pos (or the LFSR) next advances
+} ApuChannel;
+
 typedef struct {
     GBType type;
     void* fbuf;
+    // Pixel values for the 4 shades, lightest first, in whatever format the
+    // frontend wants (e.g. ARGB8888). Can be changed between frames.
+    u32 palette[4];
     bool end_frame;
 
     // Pointers to various regions of the GB's memory map
@@ -59,29 +113,83 @@ typedef struct {
     // 0xFF80-0xFFFF
     u8* hram;
 
+    // Cartridge, banked by mbc.c
+    MbcType mbc;
+    u8* rom;       // Whole ROM image, owned by whoever called make_gb
+    u16 rom_banks; // Of 16 KiB
+    u8* sram;      // Whole cartridge RAM, NULL if there is none
+    u8 sram_banks; // Of 8 KiB
+    bool has_battery;
+    // sram belongs to the frontend, see mbc_attach_battery()
+    bool sram_attached;
+    bool has_rtc;   // MBC3 with a clock
+    bool ram_en;    // Written to 0x0000-0x1FFF
+    u16 rom_bank;   // Written to 0x2000-0x3FFF
+    u8 ram_bank;    // Written to 0x4000-0x5FFF, also selects RTC registers
+    bool bank_mode; // MBC1, written to 0x6000-0x7FFF
+    u8 rtc_latch;   // MBC3, last value written to 0x6000-0x7FFF
+    u8 rtc[RTC_COUNT];
+    u64 rtc_time; // Emulated time rtc is up to date with
+    u8 rtc_latched[RTC_COUNT];
+
+    // Direct pointers to each 256-byte page of the memory map, NULL where
+    // accesses have to go through the slow path (IO, OAM, tile data writes...)
+    u8* read_map[256];
+    u8* write_map[256];
+
+    // Decoded copy of the 384 tiles at 0x8000-0x97FF, one byte per pixel
+    u8* tile_cache;
+    // Set when a tile's data in VRAM changes, cleared once it is re-decoded
+    bool tile_dirty[384];
+
     // Internal CPU registers and flags
     u8 a;
-    bool f_z, f_n, f_h, f_c;
+    // Flags are kept as what the last instruction to set them computed and
+    // only worked out when read, see flag_z() and friends in cpu.h
+    u8 f_zres;  // Z is set when this is 0
+    bool f_n;   // N is kept as is
+    u8 f_hres;  // H is bit 4, the carry into it
+    u16 f_cres; // C is bit 8, the carry into it
     u16 pc, sp;
     REG_DEF(b, c)
     REG_DEF(d, e)
     REG_DEF(h, l)
 
     bool ime;
+    bool halted;
+    // Set when HALT is skipped, the next opcode fetch doesn't advance pc
+    bool halt_bug;
+
+    // P1 (FF00)
+    u8 p1_sel;  // Bits 4-5, which button group is read
+    u8 buttons; // Held buttons, see BUTTON_*
 
     u8 sb; // FF01
     u8 sc; // FF02
 
-    // Timer registers
-    u16 div; // Upper 8 bits are FF04
-    u8 tima; // FF05
-    u8 tma;  // FF06
+    // Timer registers, worked out lazily by timer.c
+    u64 div_epoch;  // FF04 is bits 8-15 of the cycles since this
+    u8 tima;        // FF05, as of timer_time
+    u64 timer_time;
+    u8 tma; // FF06
     // TAC (FF07)
     bool tac_en; // Bit 2
     u8 tac_clk;  // Bits 0-1
 
     u8 if_; // FF0F
 
+    // Sound, run lazily by apu.c
+    u8 nr[0x17];      // FF10-FF26 as last written
+    u8 wave_ram[16];  // FF30-FF3F
+    bool apu_on;      // NR52 bit 7
+    ApuChannel ch[4]; // Square 1, square 2, wave, noise
+    u16 sweep_freq;   // Channel 1 frequency sweep
+    u8 sweep_timer;
+    bool sweep_en;
+    u16 lfsr;     // Channel 4 noise
+    u8 seq_step;  // Next frame sequencer step (0-7)
+    u64 apu_time; // Emulated time the channels are up to date with
+
     // LCDC (FF40)
     bool lcd_en;   // Bit 7
     bool win_map;  // Bit 6
@@ -109,20 +217,48 @@ typedef struct {
     u8 ie; // FFFF
 
     // Internal stuff
-    u32 cycles;
+    // Emulated time in T-cycles (4194304 Hz), never reset
+    u64 cycles;
+    // When each event is next due, and the earliest of them
+    u64 events[EVENT_COUNT];
+    u64 next_event;
     // Ranges from -80 to 375 on each scanline
     s16 dots;
+    // Time up to which the PPU has been run, or while the LCD is off, when
+    // the last frame ended
+    u64 lcd_time;
+    // Decoded instruction cache, NULL unless enabled
+    BlockCache* blocks;
+    // Translated code cache, NULL unless enabled
+    JitCache* jit;
+    // Immediate operands of the instruction being replayed from a block
+    const u8* imm;
+    // Frame history, NULL unless enabled
+    RewindBuffer* rewind;
+    // Sample output, NULL unless enabled
+    AudioOut* audio;
 } GameBoy;
 
+// Zeroed allocation that exits the program on failure
+void* crit_alloc(size_t size);
+
 // Return null if there was a problem
 GameBoy* make_gb(u8* rom, size_t size);
 void destroy_gb(GameBoy* gb);
 
 void run_frame(GameBoy* gb);
+// Updates the held buttons, should be called between frames
+void set_buttons(GameBoy* gb, u8 buttons);
+
+void map_pages(u8** map, u16 addr, u16 size, u8* mem);
+void map_memory(GameBoy* gb);
 
 u8 read(GameBoy* gb, u16 addr);
 void write(GameBoy* gb, u16 addr, u8 data);
 
 void cycle(GameBoy* gb);
+void skip_to_next_event(GameBoy* gb);
+u64 io_next_change(GameBoy* gb, u16 addr);
+void schedule(GameBoy* gb, EventType type, u64 when);
 
 #endif
\ No newline at end of file
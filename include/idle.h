@@ -0,0 +1,12 @@
+#ifndef RONDO_IDLE_H
+#define RONDO_IDLE_H
+
+#include "gb.h"
+
+// Called after a JR has jumped length bytes back to the start of a loop. If
+// the loop only polls IO registers and would keep going round unchanged
+// until the next event, skips time forward by as many whole iterations as
+// fit before it.
+void skip_idle_loop(GameBoy* gb, u8 length);
+
+#endif
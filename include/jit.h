@@ -0,0 +1,16 @@
+#ifndef RONDO_JIT_H
+#define RONDO_JIT_H
+
+#include "gb.h"
+
+// Returns false if the JIT isn't built in or executable memory isn't
+// available, in which case the interpreter keeps running everything. Also
+// enables the block cache, which runs whatever isn't translated.
+bool enable_jit(GameBoy* gb);
+void free_jit(GameBoy* gb);
+
+// Runs compiled blocks (falling back to cached blocks, then run_opcode) until
+// the end of the frame
+void run_jit(GameBoy* gb);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "gb.h"
 
-void lcd_cycle(GameBoy* gb);
+// Runs the PPU up to gb->cycles and schedules its next event
+void lcd_sync(GameBoy* gb);
+u8 lcd_read_stat(GameBoy* gb);
 
 #endif
\ No newline at end of file
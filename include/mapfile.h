@@ -0,0 +1,33 @@
+#ifndef RONDO_MAPFILE_H
+#define RONDO_MAPFILE_H
+
+// Doesn't include gb.h: the core's read() and write() would clash with the
+// POSIX ones mapfile.c needs
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+#ifdef _WIN32
+    void* mapping;
+#endif
+} MappedFile;
+
+// Maps a whole file read-only, returns false if it can't be opened or is
+// empty
+bool map_file(MappedFile* f, const char* path);
+
+// Maps size bytes of a file read-write and shared with the file, so that
+// stores end up on disk. The file is created or zero-extended if it is
+// smaller than size.
+bool map_save_file(MappedFile* f, const char* path, size_t size);
+
+// Starts writing changed pages back to disk without waiting for it
+void flush_mapped_file(MappedFile* f);
+
+void unmap_file(MappedFile* f);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef RONDO_MBC_H
+#define RONDO_MBC_H
+
+#include "gb.h"
+
+// Sets up the mapper and cartridge RAM described by the header of rom,
+// returns false if the cartridge type isn't supported
+bool mbc_init(GameBoy* gb, u8* rom, size_t size);
+
+// Bytes of cartridge RAM kept by a battery, 0 if the cartridge has none
+size_t mbc_battery_size(GameBoy* gb);
+
+// Moves the cartridge RAM to ram, which must hold mbc_battery_size() bytes
+// and outlive gb (e.g. a mapped save file). Its contents are kept, not
+// overwritten.
+void mbc_attach_battery(GameBoy* gb, u8* ram);
+
+// Points rom_lo, rom_hi and cartram at the banks the mapper registers select
+// and updates the page tables to match
+void mbc_map(GameBoy* gb);
+
+// Mapper register writes (0x0000-0x7FFF)
+void mbc_write(GameBoy* gb, u16 addr, u8 data);
+
+// 0xA000-0xBFFF while it isn't mapped directly: disabled or missing RAM, or
+// an MBC3 clock register
+u8 mbc_read_ram(GameBoy* gb, u16 addr);
+void mbc_write_ram(GameBoy* gb, u16 addr, u8 data);
+
+#endif
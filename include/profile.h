@@ -0,0 +1,32 @@
+#ifndef RONDO_PROFILE_H
+#define RONDO_PROFILE_H
+
+#include "gb.h"
+
+// Per-opcode profiler, built in with RONDO_PROFILE and otherwise absent.
+// run_opcode and op_cb report every instruction they run: how often each
+// opcode and CB opcode runs and how much host time it takes, and how often
+// each PC and each ROM bank is executed from. Profiling builds run everything
+// through the function pointer interpreter so that nothing is missed.
+#ifdef RONDO_PROFILE
+
+// Host timestamp in arbitrary units (TSC ticks on x86). Times include the
+// cost of taking them, so compare opcodes with each other rather than with
+// rondo-bench's numbers.
+u64 profile_ticks(void);
+
+// An instruction at pc (including any CB opcode it ran) took ticks
+void profile_op(GameBoy* gb, u16 pc, u8 opcode, u64 ticks);
+// The CB opcode part of an instruction took ticks
+void profile_cb(u8 opcode, u64 ticks);
+
+// Instructions counted so far
+u64 profile_count(void);
+
+// Writes everything counted so far as a report sorted by time to
+// <prefix>.txt and as raw CSV to <prefix>.csv
+void profile_write(const char* prefix);
+
+#endif
+
+#endif
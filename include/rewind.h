@@ -0,0 +1,19 @@
+#ifndef RONDO_REWIND_H
+#define RONDO_REWIND_H
+
+#include "gb.h"
+
+// Keeps a snapshot of every frame run_frame completes, using up to capacity
+// bytes for the history (plus a few snapshots' worth of working buffers)
+void enable_rewind(GameBoy* gb, size_t capacity);
+void free_rewind(GameBoy* gb);
+
+// Called by run_frame at the end of every frame
+void rewind_push(GameBoy* gb);
+
+// Goes back to the end of the previous frame, redrawing the framebuffer
+// unless it is the oldest one left. Returns false if there is no more
+// history.
+bool rewind_step(GameBoy* gb);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef RONDO_RING_H
+#define RONDO_RING_H
+
+#include "gb.h"
+#include "stdatomic.h"
+
+// Lock-free byte queue between exactly one producer thread and one consumer
+// thread. Each side only ever advances its own index.
+typedef struct {
+    u8* data;
+    size_t size; // Power of two
+    // Free-running counts of bytes written and read
+    atomic_size_t head;
+    atomic_size_t tail;
+} Ring;
+
+// size must be a power of two
+void init_ring(Ring* ring, size_t size);
+void free_ring(Ring* ring);
+
+// Bytes that can be written or read right now
+size_t ring_space(Ring* ring);
+size_t ring_available(Ring* ring);
+
+// Copy as many of the size bytes as fit or are there, return how many did
+size_t ring_write(Ring* ring, const void* data, size_t size);
+size_t ring_read(Ring* ring, void* data, size_t size);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef RONDO_SIMD_H
+#define RONDO_SIMD_H
+
+#include "gb.h"
+
+// Decodes rows of 2bpp planar tile data, laid out as in VRAM (lsb plane byte
+// then msb plane byte for each row), into 8 color indices (0-3) per row.
+// Uses SSE2 or AVX2 when the host supports them.
+void decode_tile_rows(const u8* src, u8* dst, int rows);
+
+// Turns count color indices into 32-bit pixels: each index picks a shade
+// (0-3) from a palette register as split up in bgp/obp0/obp1, and the shade
+// picks one of colors. Uses SSE2 or AVX2 when the host supports them.
+void expand_palette(const u8* src, u32* dst, int count, const u8 shades[4],
+                    const u32 colors[4]);
+
+// Adds src times scale to dst, count floats of each. Uses SSE2 or AVX2 when
+// the host supports them, which give the same results as the plain loop.
+void add_scaled(float* dst, const float* src, float scale, int count);
+
+#endif
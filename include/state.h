@@ -0,0 +1,19 @@
+#ifndef RONDO_STATE_H
+#define RONDO_STATE_H
+
+#include "gb.h"
+
+// Bumped whenever the layout of a save state changes
+#define STATE_VERSION 7
+
+// Exact number of bytes save_state writes for gb
+size_t state_size(GameBoy* gb);
+
+// Serializes gb into buf, returns false if buf is too small
+bool save_state(GameBoy* gb, u8* buf, size_t size);
+
+// Restores a state made by save_state into gb's existing buffers, returns
+// false (leaving gb untouched) if it isn't a valid state for gb
+bool load_state(GameBoy* gb, const u8* buf, size_t size);
+
+#endif
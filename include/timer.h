@@ -0,0 +1,16 @@
+#ifndef RONDO_TIMER_H
+#define RONDO_TIMER_H
+
+#include "gb.h"
+
+// DIV, TIMA, TMA and TAC (FF04-FF07), addr is the low byte
+u8 timer_read(GameBoy* gb, u8 addr);
+void timer_write(GameBoy* gb, u8 addr, u8 data);
+
+// EVENT_TIMER handler, reloads TIMA from TMA one M-cycle after it overflows
+void timer_reload(GameBoy* gb);
+
+// Cycle at which DIV or TIMA will next change on its own
+u64 timer_next_change(GameBoy* gb, u16 addr);
+
+#endif
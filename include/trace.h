@@ -0,0 +1,54 @@
+#ifndef RONDO_TRACE_H
+#define RONDO_TRACE_H
+
+#include "gb.h"
+
+// Execution trace, built in with RONDO_TRACE and otherwise absent. Every
+// instruction run_opcode starts is recorded in a fixed-size ring, which is
+// written out when the emulator crashes or when asked. rondo-trace decodes
+// the dumps. Like profiling, tracing builds run everything through run_opcode.
+
+// One instruction, with the registers as they were before it ran. Fields are
+// in host byte order and laid out without padding.
+typedef struct {
+    u64 cycles;
+    u16 pc;
+    u16 sp;
+    u8 bytes[3]; // Opcode and the two bytes after it
+    u8 a, f, b, c, d, e, h, l;
+    u8 flags; // TRACE_*
+} TraceRecord;
+
+#define TRACE_IME (1 << 0)
+#define TRACE_HALT_BUG (1 << 1)
+
+// A dump is a TraceHeader, then count records from oldest to newest
+#define TRACE_MAGIC "RTRC"
+#define TRACE_VERSION 1
+typedef struct {
+    char magic[4];
+    u16 version;
+    u16 record_size;
+    u32 count;
+    u32 reserved;
+} TraceHeader;
+
+// Where the frontend and the crash paths write dumps
+#define TRACE_FILE "rondo-trace.bin"
+
+#ifdef RONDO_TRACE
+
+void trace_op(GameBoy* gb);
+
+// Writes the records in the ring to filename, returning false if it can't
+bool trace_dump(const char* filename);
+// Dumps to TRACE_FILE before the emulator exits on an error
+void trace_crash(void);
+
+#else
+
+static inline void trace_crash(void) {}
+
+#endif
+
+#endif
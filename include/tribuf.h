@@ -0,0 +1,31 @@
+#ifndef RONDO_TRIBUF_H
+#define RONDO_TRIBUF_H
+
+#include "gb.h"
+#include "stdatomic.h"
+
+// Lock-free hand-over of frames from one producer thread to one consumer
+// thread. The producer fills the back buffer and publishes it, the consumer
+// takes whichever frame was published last, and neither ever waits.
+typedef struct {
+    u8* bufs[3];
+    // Index of the buffer between the two sides, plus TRIBUF_FRESH if the
+    // producer has published it since the consumer last took one
+    atomic_uint middle;
+    unsigned back;  // Producer's
+    unsigned front; // Consumer's
+} TripleBuffer;
+
+void init_tribuf(TripleBuffer* tb, size_t size);
+void free_tribuf(TripleBuffer* tb);
+
+// Buffer for the producer to fill
+u8* tribuf_back(TripleBuffer* tb);
+// Hands the back buffer to the consumer, replacing any it hasn't taken yet
+void tribuf_publish(TripleBuffer* tb);
+
+// Newest published buffer, or NULL if nothing was published since the last
+// call. It stays the consumer's until the next successful call.
+u8* tribuf_take(TripleBuffer* tb);
+
+#endif
@@ -0,0 +1,637 @@
+#include "apu.h"
+#include "math.h"
+#include "simd.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Nothing here runs per cycle. The channels are only brought up to date when
+// something depends on them: a register write, a frame sequencer step or the
+// end of a frame. apu_sync then advances them in one go.
+//
+// Output is band-limited step synthesis. Whenever the mix changes, at
+// whatever T-cycle that happens, a band-limited impulse of the size of the
+// change is added to a buffer at the host rate, at the fractional sample
+// position the cycle falls on. Running sums of the buffer give the output.
+// This both resamples from the DMG clock and removes the aliasing of the
+// square edges, at a cost per change rather than per cycle. Steps that can't
+// be heard, on a muted channel or one routed nowhere, cost no impulse.
+
+// Register x (0-4) of channel i, channel registers are 5 apart from FF10
+#define NR(i, x) gb->nr[5 * (i) + (x)]
+#define NR50 0x14
+#define NR51 0x15
+#define NR52 0x16
+
+// Bits that read back as 1, for FF10-FF2F
+static const u8 read_masks[0x20] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, // NR10-NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF, // NR20-NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF, // NR30-NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF, // NR40-NR44
+    0x00, 0x00, 0x70,             // NR50-NR52
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+// Steps (bit 0 first) at which each duty cycle is high
+static const u8 duty_patterns[4] = {0x80, 0x81, 0xE1, 0x7E};
+
+// Noise timer periods in T-cycles before the NR43 shift
+static const u8 noise_divisors[8] = {8, 16, 32, 48, 64, 80, 96, 112};
+
+// The sequencer is clocked by falling edges of this divider bit
+#define SEQ_PERIOD 8192
+
+// Impulses are WIDTH samples long, with PHASES versions offset by fractions
+// of a sample
+#define WIDTH 16
+#define PHASES 32
+#define PHASE_BITS 5
+static float kernels[PHASES][WIDTH];
+static bool kernels_ready;
+
+// Cycles run between checks that the buffer has room
+#define SYNC_CHUNK 8192
+
+// From mix levels (at most 4 * 15 * 8 either way) to s16, leaving headroom
+// for the filter and the impulses' overshoot
+#define OUTPUT_SCALE 32.0f
+
+struct AudioOut {
+    // Impulses for each side, the live part being up to pos plus WIDTH
+    float* buf[2];
+    size_t capacity;
+    u32 rate;
+    // Position of apu_time in the buffer, and how far each T-cycle moves it,
+    // both in samples with 32 fractional bits
+    u64 pos;
+    u64 step;
+    // Mix levels the impulses so far add up to, and each channel's part
+    int level[2];
+    int amp[4];
+    // High-pass filter standing in for the output capacitor, which removes
+    // the DC offset of the DACs. Applied to the running sum of the impulses,
+    // it comes down to a leaky sum of the impulses themselves, so only its
+    // last output is kept.
+    float charge;
+    float filtered[2];
+};
+
+// Windowed sinc impulses, each summing to 1 so that the steps they make
+// land exactly on the new level
+static void init_kernels() {
+    // A little below Nyquist, for the window's transition band
+    const double cutoff = 0.9;
+    for (int p = 0; p < PHASES; p++) {
+        double center = WIDTH / 2 - 1 + (double)p / PHASES;
+        double total = 0;
+        for (int k = 0; k < WIDTH; k++) {
+            double x = k - center;
+            double sinc = x == 0 ? cutoff : sin(M_PI * cutoff * x) / (M_PI * x);
+            // Blackman window over the impulse's width
+            double w = (x + WIDTH / 2) / WIDTH;
+            double window =
+                0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+            kernels[p][k] = sinc * window;
+            total += sinc * window;
+        }
+        for (int k = 0; k < WIDTH; k++) {
+            kernels[p][k] /= total;
+        }
+    }
+}
+
+static bool dac_on(GameBoy* gb, int i) {
+    return i == 2 ? NR(2, 0) & 0x80 : NR(i, 2) & 0xF8;
+}
+
+static u32 period(GameBoy* gb, int i) {
+    u32 freq = NR(i, 3) | (NR(i, 4) & 7) << 8;
+    switch (i) {
+    case 0:
+    case 1:
+        return (2048 - freq) * 4;
+    case 2:
+        return (2048 - freq) * 2;
+    default:
+        return noise_divisors[NR(3, 3) & 7] << (NR(3, 3) >> 4);
+    }
+}
+
+// The noise LFSR after one step, narrow being NR43's 7-bit mode
+static u16 step_lfsr(u16 lfsr, bool narrow) {
+    u16 bit = (lfsr ^ (lfsr >> 1)) & 1;
+    lfsr = (lfsr >> 1) | (bit << 14);
+    if (narrow) {
+        // 7-bit mode also feeds the result into bit 6
+        lfsr = (lfsr & ~0x40) | (bit << 6);
+    }
+    return lfsr;
+}
+
+// DAC output of channel i, from -15 to 15 (0 with the DAC off)
+static int channel_output(GameBoy* gb, int i) {
+    ApuChannel* ch = &gb->ch[i];
+    if (!dac_on(gb, i)) {
+        return 0;
+    }
+    int level = 0;
+    if (ch->on) {
+        switch (i) {
+        case 0:
+        case 1:
+            if (duty_patterns[NR(i, 1) >> 6] & (1 << ch->pos)) {
+                level = ch->volume;
+            }
+            break;
+        case 2: {
+            // Volume code 0 mutes, 1-3 shift right by 0-2
+            u8 code = (NR(2, 2) >> 5) & 3;
+            u8 sample = gb->wave_ram[ch->pos / 2];
+            sample = ch->pos & 1 ? sample & 0xF : sample >> 4;
+            level = code ? sample >> (code - 1) : 0;
+            break;
+        }
+        case 3:
+            if (!(gb->lfsr & 1)) {
+                level = ch->volume;
+            }
+            break;
+        }
+    }
+    return 2 * level - 15;
+}
+
+// How much of channel i goes to side (0 left, 1 right) of the mix
+static int gain(GameBoy* gb, int side, int i) {
+    if (!gb->apu_on || !(gb->nr[NR51] & ((side ? 0x01 : 0x10) << i))) {
+        return 0;
+    }
+    return ((gb->nr[NR50] >> (side ? 0 : 4)) & 7) + 1;
+}
+
+static void add_impulse(AudioOut* out, int side, u64 when, int delta) {
+    u32 phase = (u32)when >> (32 - PHASE_BITS);
+    add_scaled(out->buf[side] + (when >> 32), kernels[phase],
+               delta * OUTPUT_SCALE, WIDTH);
+}
+
+// A step in a channel's level at buffer position when
+typedef struct {
+    u64 when;
+    int delta;
+} Change;
+
+// Changes noted before they're turned into impulses
+#define CHANGE_BATCH 64
+
+// Adds the impulses for count changes of a channel with gains g
+static void add_changes(AudioOut* out, const Change* changes, int count,
+                        const int g[2]) {
+    for (int side = 0; side < 2; side++) {
+        if (!g[side]) {
+            continue;
+        }
+        for (int n = 0; n < count; n++) {
+            add_impulse(out, side, changes[n].when, g[side] * changes[n].delta);
+        }
+    }
+}
+
+// Catches the output up with any change at the present, after a register
+// write or sequencer step
+static void update_output(GameBoy* gb) {
+    AudioOut* out = gb->audio;
+    if (!out) {
+        return;
+    }
+    int level[2] = {0, 0};
+    for (int i = 0; i < 4; i++) {
+        out->amp[i] = channel_output(gb, i);
+        for (int side = 0; side < 2; side++) {
+            level[side] += gain(gb, side, i) * out->amp[i];
+        }
+    }
+    for (int side = 0; side < 2; side++) {
+        if (level[side] != out->level[side]) {
+            add_impulse(out, side, out->pos, level[side] - out->level[side]);
+            out->level[side] = level[side];
+        }
+    }
+}
+
+// Advances channel i's frequency timer by cycles, from position pos
+static void run_channel(GameBoy* gb, int i, u64 cycles, u64 pos) {
+    ApuChannel* ch = &gb->ch[i];
+    if (!ch->on) {
+        // A trigger starts the timer afresh
+        return;
+    }
+    if (cycles < ch->timer) {
+        ch->timer -= cycles;
+        return;
+    }
+    AudioOut* out = gb->audio;
+    u32 p = period(gb, i);
+    // The registers hold still until the next sync, so where the channel
+    // goes and the levels it switches between are fixed for this run. Steps
+    // that go nowhere or can't change the level aren't heard.
+    int g[2] = {0, 0};
+    if (out && dac_on(gb, i)) {
+        g[0] = gain(gb, 0, i);
+        g[1] = gain(gb, 1, i);
+    }
+    // Volume code 0 mutes, 1-3 shift right by 0-2
+    u8 code = (NR(2, 2) >> 5) & 3;
+    bool audible = i == 2 ? code != 0 : ch->volume != 0;
+    if ((g[0] || g[1]) && audible) {
+        // Step by step, noting the steps that change the channel's level.
+        // The position and LFSR are kept in locals, as stores through gb
+        // would have to be assumed to change anything.
+        Change changes[CHANGE_BATCH];
+        int count = 0;
+        int high = 2 * ch->volume - 15;
+        u8 duty = duty_patterns[NR(i, 1) >> 6];
+        bool narrow = NR(3, 3) & 0x08;
+        u8 step = ch->pos;
+        u16 lfsr = gb->lfsr;
+        int amp = out->amp[i];
+        u64 t = ch->timer;
+        for (; t <= cycles; t += p) {
+            int next;
+            if (i == 3) {
+                lfsr = step_lfsr(lfsr, narrow);
+                next = lfsr & 1 ? -15 : high;
+            } else if (i == 2) {
+                step = (step + 1) & 31;
+                u8 sample = gb->wave_ram[step / 2];
+                sample = step & 1 ? sample & 0xF : sample >> 4;
+                next = 2 * (sample >> (code - 1)) - 15;
+            } else {
+                step = (step + 1) & 7;
+                next = duty & (1 << step) ? high : -15;
+            }
+            // Written either way and only kept if there's a change, which
+            // for noise is too random to branch on
+            changes[count].when = pos + t * out->step;
+            changes[count].delta = next - amp;
+            count += next != amp;
+            amp = next;
+            if (count == CHANGE_BATCH) {
+                add_changes(out, changes, count, g);
+                count = 0;
+            }
+        }
+        add_changes(out, changes, count, g);
+        for (int side = 0; side < 2; side++) {
+            out->level[side] += g[side] * (amp - out->amp[i]);
+        }
+        out->amp[i] = amp;
+        ch->pos = step;
+        gb->lfsr = lfsr;
+        ch->timer = t - cycles;
+        return;
+    }
+    cycles -= ch->timer;
+    u64 steps = 1 + cycles / p;
+    ch->timer = p - cycles % p;
+    if (i == 3) {
+        bool narrow = NR(3, 3) & 0x08;
+        u16 lfsr = gb->lfsr;
+        for (u64 n = 0; n < steps; n++) {
+            lfsr = step_lfsr(lfsr, narrow);
+        }
+        gb->lfsr = lfsr;
+    } else {
+        ch->pos = (ch->pos + steps) & (i == 2 ? 31 : 7);
+    }
+}
+
+static void run_channels(GameBoy* gb, u64 cycles, u64 pos) {
+    for (int i = 0; i < 4; i++) {
+        run_channel(gb, i, cycles, pos);
+    }
+}
+
+static s16 clamp_sample(float x) {
+    return x > 32767 ? 32767 : x < -32768 ? -32768 : (s16)x;
+}
+
+// Runs count samples of one side through the filter in place, from y being
+// its last output, and returns the new last output. Each output is the
+// impulse plus charge times the one before, which done in order is one long
+// chain of dependent multiply-adds. Taking four at a time, their dependence
+// on the output before them is a single multiply-add each, and the rest can
+// be worked out ahead.
+static float filter_samples(float* buf, size_t count, float y, float charge) {
+    const float k1 = charge;
+    const float k2 = k1 * k1;
+    const float k3 = k2 * k1;
+    const float k4 = k2 * k2;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        float p0 = buf[i];
+        float p1 = buf[i + 1] + k1 * p0;
+        float p2 = buf[i + 2] + k1 * p1;
+        float p3 = buf[i + 3] + k1 * p2;
+        buf[i] = p0 + k1 * y;
+        buf[i + 1] = p1 + k2 * y;
+        buf[i + 2] = p2 + k3 * y;
+        buf[i + 3] = p3 + k4 * y;
+        y = buf[i + 3];
+    }
+    for (; i < count; i++) {
+        y = buf[i] + k1 * y;
+        buf[i] = y;
+    }
+    return y;
+}
+
+// Turns the first count samples of the buffer into output (if dst isn't
+// NULL) and moves the rest up
+static void take_samples(AudioOut* out, s16* dst, size_t count) {
+    size_t live = (out->pos >> 32) + WIDTH;
+    for (int side = 0; side < 2; side++) {
+        float* buf = out->buf[side];
+        out->filtered[side] =
+            filter_samples(buf, count, out->filtered[side], out->charge);
+        if (dst) {
+            for (size_t i = 0; i < count; i++) {
+                dst[2 * i + side] = clamp_sample(buf[i]);
+            }
+        }
+        memmove(buf, buf + count, (live - count) * sizeof(float));
+        memset(buf + live - count, 0, count * sizeof(float));
+    }
+    out->pos -= (u64)count << 32;
+}
+
+void apu_sync(GameBoy* gb) {
+    u64 cycles = gb->cycles - gb->apu_time;
+    gb->apu_time = gb->cycles;
+    AudioOut* out = gb->audio;
+    if (!out) {
+        run_channels(gb, cycles, 0);
+        return;
+    }
+    while (cycles) {
+        u64 n = cycles < SYNC_CHUNK ? cycles : SYNC_CHUNK;
+        if ((out->pos + n * out->step) >> 32 >= out->capacity) {
+            // Nobody is taking them, drop the oldest
+            take_samples(out, NULL, out->capacity / 2);
+        }
+        run_channels(gb, n, out->pos);
+        out->pos += n * out->step;
+        cycles -= n;
+    }
+}
+
+// Works out the next swept frequency, switching channel 1 off on overflow
+static u16 sweep_calc(GameBoy* gb) {
+    u16 delta = gb->sweep_freq >> (NR(0, 0) & 7);
+    u16 freq =
+        NR(0, 0) & 0x08 ? gb->sweep_freq - delta : gb->sweep_freq + delta;
+    if (freq > 2047) {
+        gb->ch[0].on = false;
+    }
+    return freq;
+}
+
+static void clock_sweep(GameBoy* gb) {
+    if (--gb->sweep_timer) {
+        return;
+    }
+    u8 pace = (NR(0, 0) >> 4) & 7;
+    gb->sweep_timer = pace ? pace : 8;
+    if (!gb->sweep_en || !pace) {
+        return;
+    }
+    u16 freq = sweep_calc(gb);
+    if (freq <= 2047 && (NR(0, 0) & 7)) {
+        gb->sweep_freq = freq;
+        NR(0, 3) = freq;
+        NR(0, 4) = (NR(0, 4) & ~7) | (freq >> 8);
+        // Checked again with the new frequency, but not applied
+        sweep_calc(gb);
+    }
+}
+
+static void clock_lengths(GameBoy* gb) {
+    for (int i = 0; i < 4; i++) {
+        ApuChannel* ch = &gb->ch[i];
+        if ((NR(i, 4) & 0x40) && ch->length && !--ch->length) {
+            ch->on = false;
+        }
+    }
+}
+
+static void clock_envelopes(GameBoy* gb) {
+    for (int i = 0; i < 4; i++) {
+        if (i == 2) {
+            continue;
+        }
+        ApuChannel* ch = &gb->ch[i];
+        u8 pace = NR(i, 2) & 7;
+        if (!pace || --ch->env_timer) {
+            continue;
+        }
+        ch->env_timer = pace;
+        if (NR(i, 2) & 0x08) {
+            if (ch->volume < 15) {
+                ch->volume++;
+            }
+        } else if (ch->volume > 0) {
+            ch->volume--;
+        }
+    }
+}
+
+// Runs one step of the frame sequencer
+static void sequencer_step(GameBoy* gb) {
+    if (!gb->apu_on) {
+        return;
+    }
+    u8 step = gb->seq_step;
+    gb->seq_step = (step + 1) & 7;
+    if (!(step & 1)) {
+        clock_lengths(gb);
+    }
+    if (step == 2 || step == 6) {
+        clock_sweep(gb);
+    }
+    if (step == 7) {
+        clock_envelopes(gb);
+    }
+}
+
+// Schedules the next falling edge of the sequencer's divider bit
+static void schedule_step(GameBoy* gb) {
+    u64 since = gb->cycles - gb->div_epoch;
+    schedule(gb, EVENT_APU,
+             gb->div_epoch + (since / SEQ_PERIOD + 1) * SEQ_PERIOD);
+}
+
+void apu_step(GameBoy* gb) {
+    apu_sync(gb);
+    sequencer_step(gb);
+    update_output(gb);
+    schedule_step(gb);
+}
+
+void apu_div_reset(GameBoy* gb, bool edge) {
+    apu_sync(gb);
+    if (edge) {
+        sequencer_step(gb);
+        update_output(gb);
+    }
+    schedule_step(gb);
+}
+
+static void trigger(GameBoy* gb, int i) {
+    ApuChannel* ch = &gb->ch[i];
+    ch->on = dac_on(gb, i);
+    if (!ch->length) {
+        ch->length = i == 2 ? 256 : 64;
+    }
+    ch->timer = period(gb, i);
+    if (i == 2) {
+        ch->pos = 0;
+        return;
+    }
+    ch->volume = NR(i, 2) >> 4;
+    ch->env_timer = NR(i, 2) & 7;
+    if (i == 3) {
+        gb->lfsr = 0x7FFF;
+    } else if (i == 0) {
+        u8 pace = (NR(0, 0) >> 4) & 7;
+        gb->sweep_freq = NR(0, 3) | (NR(0, 4) & 7) << 8;
+        gb->sweep_timer = pace ? pace : 8;
+        gb->sweep_en = pace || (NR(0, 0) & 7);
+        if (NR(0, 0) & 7) {
+            sweep_calc(gb);
+        }
+    }
+}
+
+u8 apu_read(GameBoy* gb, u8 addr) {
+    // Nothing readable changes between syncs: channels only stop in
+    // sequencer steps and register writes
+    if (addr >= 0x30) {
+        return gb->wave_ram[addr - 0x30];
+    }
+    u8 reg = addr - 0x10;
+    if (reg == NR52) {
+        u8 status = 0;
+        for (int i = 0; i < 4; i++) {
+            status |= gb->ch[i].on << i;
+        }
+        return read_masks[reg] | (gb->apu_on << 7) | status;
+    }
+    return read_masks[reg] | (reg < NR52 ? gb->nr[reg] : 0xFF);
+}
+
+static void write_register(GameBoy* gb, u8 addr, u8 data) {
+    if (addr >= 0x30) {
+        gb->wave_ram[addr - 0x30] = data;
+        return;
+    }
+    u8 reg = addr - 0x10;
+    if (reg == NR52) {
+        bool on = data & 0x80;
+        if (gb->apu_on && !on) {
+            // Powering off clears every register
+            memset(gb->nr, 0, sizeof(gb->nr));
+            for (int i = 0; i < 4; i++) {
+                gb->ch[i].on = false;
+            }
+        } else if (!gb->apu_on && on) {
+            gb->seq_step = 0;
+        }
+        gb->apu_on = on;
+        return;
+    }
+    if (!gb->apu_on || reg > NR52) {
+        return;
+    }
+
+    gb->nr[reg] = data;
+    if (reg >= NR50) {
+        return;
+    }
+    int i = reg / 5;
+    switch (reg % 5) {
+    case 1: // Length
+        gb->ch[i].length = i == 2 ? 256 - data : 64 - (data & 0x3F);
+        break;
+    case 2: // Envelope, or the wave channel's volume
+    case 0: // Wave DAC (NR30), and sweep for channel 1
+        if (!dac_on(gb, i)) {
+            gb->ch[i].on = false;
+        }
+        break;
+    case 4:
+        if (data & 0x80) {
+            trigger(gb, i);
+        }
+        break;
+    }
+}
+
+void apu_write(GameBoy* gb, u8 addr, u8 data) {
+    apu_sync(gb);
+    write_register(gb, addr, data);
+    update_output(gb);
+}
+
+void enable_audio(GameBoy* gb, u32 rate) {
+    if (gb->audio) {
+        return;
+    }
+    if (!kernels_ready) {
+        init_kernels();
+        kernels_ready = true;
+    }
+    AudioOut* out = crit_alloc(sizeof(AudioOut));
+    out->rate = rate;
+    // A tenth of a second, more than a frame's worth
+    out->capacity = rate / 10;
+    for (int side = 0; side < 2; side++) {
+        out->buf[side] = crit_alloc((out->capacity + WIDTH) * sizeof(float));
+    }
+    gb->audio = out;
+    set_audio_ratio(gb, 1);
+    // The capacitor keeps 0.999958 of its charge each T-cycle
+    out->charge = pow(0.999958, (double)CYCLES_PER_SECOND / rate);
+    update_output(gb);
+}
+
+void set_audio_ratio(GameBoy* gb, double ratio) {
+    AudioOut* out = gb->audio;
+    if (out) {
+        out->step = (u64)(out->rate * ratio * 4294967296.0 / CYCLES_PER_SECOND);
+    }
+}
+
+void free_audio(GameBoy* gb) {
+    if (gb->audio) {
+        free(gb->audio->buf[0]);
+        free(gb->audio->buf[1]);
+        free(gb->audio);
+        gb->audio = NULL;
+    }
+}
+
+void apu_resync(GameBoy* gb) { update_output(gb); }
+
+size_t apu_read_samples(GameBoy* gb, s16* dst, size_t max) {
+    AudioOut* out = gb->audio;
+    if (!out) {
+        return 0;
+    }
+    // Later changes can't affect the samples before pos
+    size_t count = out->pos >> 32;
+    if (count > max) {
+        count = max;
+    }
+    take_samples(out, dst, count);
+    return count;
+}
@@ -0,0 +1,260 @@
+#include "block.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Direct-mapped, indexed by pc
+#define BLOCK_CACHE_SIZE 2048
+
+// A RAM page that keeps getting its code overwritten is not worth caching
+#define MAX_PAGE_INVALIDATIONS 16
+
+struct BlockCache {
+    Block blocks[BLOCK_CACHE_SIZE];
+    // Number of times each RAM page (by address) has had its blocks dropped
+    u8 invalidations[256];
+    // Whether blocks have been decoded from each RAM page (by address)
+    bool code_pages[256];
+};
+
+void enable_block_cache(GameBoy* gb) {
+    if (!gb->blocks) {
+        gb->blocks = calloc(1, sizeof(BlockCache));
+        if (!gb->blocks) {
+            printf("Memory allocation failed!");
+            exit(1);
+        }
+    }
+}
+
+void free_block_cache(GameBoy* gb) {
+    if (gb->blocks) {
+        // Give the code pages back their direct write pointers
+        map_memory(gb);
+        free(gb->blocks);
+        gb->blocks = NULL;
+    }
+}
+
+static bool is_ram_page(u8 page) { return page >= 0xC0 && page < 0xFE; }
+
+// WRAM is visible twice (0xC000-0xDDFF is echoed at 0xE000-0xFDFF)
+static int echo_page(u8 page) {
+    if (page >= 0xC0 && page < 0xDE) {
+        return page + 0x20;
+    } else if (page >= 0xE0 && page < 0xFE) {
+        return page - 0x20;
+    }
+    return -1;
+}
+
+// Instructions after which execution doesn't simply fall through
+static bool ends_block(u8 opcode) {
+    switch (opcode) {
+    case 0x10: // STOP
+    case 0x18: // JR e
+    case 0x20: // JR cc, e
+    case 0x28:
+    case 0x30:
+    case 0x38:
+    case 0x76: // HALT
+    case 0xC0: // RET cc
+    case 0xC8:
+    case 0xD0:
+    case 0xD8:
+    case 0xC2: // JP cc, nn
+    case 0xCA:
+    case 0xD2:
+    case 0xDA:
+    case 0xC3: // JP nn
+    case 0xE9: // JP HL
+    case 0xC4: // CALL cc, nn
+    case 0xCC:
+    case 0xD4:
+    case 0xDC:
+    case 0xCD: // CALL nn
+    case 0xC9: // RET
+    case 0xD9: // RETI
+    case 0xC7: // RST n
+    case 0xCF:
+    case 0xD7:
+    case 0xDF:
+    case 0xE7:
+    case 0xEF:
+    case 0xF7:
+    case 0xFF:
+    case 0xD3: // Illegal
+    case 0xDB:
+    case 0xDD:
+    case 0xE3:
+    case 0xE4:
+    case 0xEB:
+    case 0xEC:
+    case 0xED:
+    case 0xF4:
+    case 0xFC:
+    case 0xFD:
+        return true;
+    default:
+        return false;
+    }
+}
+
+int decode_block(GameBoy* gb, u16 pc, DecodedOp* ops, int max) {
+    u8* page = gb->read_map[pc >> 8];
+    if (!page) {
+        return 0;
+    }
+
+    int count = 0;
+    u16 offset = pc & 0xFF;
+    while (count < max) {
+        u8 opcode = page[offset];
+        u8 length = op_lengths[opcode];
+        if (offset + length > 0x100) {
+            // Instruction straddles two pages
+            break;
+        }
+
+        DecodedOp* op = &ops[count++];
+        op->length = length;
+        if (opcode == 0xCB) {
+            u8 cb_opcode = page[offset + 1];
+            op->func = cb_handler(cb_opcode);
+            op->fetch = 2;
+        } else {
+            op->func = op_handler(opcode);
+            op->fetch = 1;
+            memcpy(op->imm, page + offset + 1, length - 1);
+        }
+
+        offset += length;
+        if (ends_block(opcode) || offset == 0x100) {
+            break;
+        }
+    }
+    return count;
+}
+
+// Returns the block for the current pc, decoding it if needed, or NULL if the
+// code there can't be cached
+static Block* get_block(GameBoy* gb) {
+    BlockCache* cache = gb->blocks;
+    u16 pc = gb->pc;
+    u8* page = gb->read_map[pc >> 8];
+    Block* block = &cache->blocks[pc % BLOCK_CACHE_SIZE];
+    if (block->valid && block->pc == pc && block->page == page) {
+        return block;
+    }
+
+    // Only ROM and WRAM are cached; other RAM would need its own write hooks
+    u8 page_idx = pc >> 8;
+    bool in_ram = is_ram_page(page_idx);
+    if (!page || !(pc < 0x8000 || in_ram)) {
+        return NULL;
+    }
+    if (in_ram && cache->invalidations[page_idx] >= MAX_PAGE_INVALIDATIONS) {
+        return NULL;
+    }
+
+    block->count = decode_block(gb, pc, block->ops, BLOCK_MAX_OPS);
+    if (!block->count) {
+        return NULL;
+    }
+    block->pc = pc;
+    block->page = page;
+    block->valid = true;
+
+    if (in_ram) {
+        // Send writes to this page (and its echo) through write_slow so that
+        // they can invalidate the block
+        cache->code_pages[page_idx] = true;
+        gb->write_map[page_idx] = NULL;
+        int echo = echo_page(page_idx);
+        if (echo >= 0) {
+            cache->code_pages[echo] = true;
+            gb->write_map[echo] = NULL;
+        }
+    }
+    return block;
+}
+
+void block_invalidate_page(GameBoy* gb, u16 addr) {
+    BlockCache* cache = gb->blocks;
+    u8 page_idx = addr >> 8;
+    if (!cache || !cache->code_pages[page_idx]) {
+        return;
+    }
+
+    u8* page = gb->read_map[page_idx];
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        if (cache->blocks[i].page == page) {
+            cache->blocks[i].valid = false;
+        }
+    }
+
+    int echo = echo_page(page_idx);
+    cache->code_pages[page_idx] = false;
+    gb->write_map[page_idx] = page;
+    if (echo >= 0) {
+        cache->code_pages[echo] = false;
+        gb->write_map[echo] = gb->read_map[echo];
+    }
+    if (cache->invalidations[page_idx] < MAX_PAGE_INVALIDATIONS) {
+        cache->invalidations[page_idx]++;
+    }
+}
+
+// Drops every block decoded from RAM without counting it against the pages,
+// for when all of RAM is replaced at once. Expects the page tables to have
+// just been rebuilt by map_memory.
+void block_drop_ram(GameBoy* gb) {
+    BlockCache* cache = gb->blocks;
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        if (is_ram_page(cache->blocks[i].pc >> 8)) {
+            cache->blocks[i].valid = false;
+        }
+    }
+    memset(cache->code_pages, 0, sizeof(cache->code_pages));
+}
+
+bool run_block(GameBoy* gb) {
+    Block* block = get_block(gb);
+    if (!block) {
+        return false;
+    }
+
+    u16 pc = block->pc;
+    for (int i = 0; i < block->count; i++) {
+        DecodedOp* op = &block->ops[i];
+        // Opcode fetch timing, without the fetch itself
+        for (int j = 0; j < op->fetch; j++) {
+            cycle(gb);
+        }
+        gb->pc = pc + op->fetch;
+        gb->imm = op->imm;
+        op->func(gb);
+        gb->imm = NULL;
+        pc += op->length;
+
+        // Leave at an instruction boundary if anything changed under us:
+        // the frame ended, an interrupt is due, the code was overwritten or
+        // the ROM bank was switched
+        if (gb->end_frame || interrupt_pending(gb) || !block->valid ||
+            gb->read_map[block->pc >> 8] != block->page) {
+            break;
+        }
+    }
+    return true;
+}
+
+void run_blocks(GameBoy* gb) {
+    while (!gb->end_frame) {
+        if (needs_run_opcode(gb) || !run_block(gb)) {
+            run_opcode(gb);
+        }
+    }
+}
@@ -1,4 +1,9 @@
 #include "cpu.h"
+#include "block.h"
+#include "idle.h"
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
 #include "stdio.h"
 #include "stdlib.h"
 
@@ -7,7 +12,16 @@ u8 read_cycle(GameBoy* gb, u16 addr) {
     cycle(gb);
     return data;
 }
-u8 read_imm_cycle(GameBoy* gb) { return read_cycle(gb, gb->pc++); }
+// Immediates come from the decoded block instead of the bus when one is being
+// replayed (see block.c)
+u8 read_imm_cycle(GameBoy* gb) {
+    if (gb->imm) {
+        gb->pc++;
+        cycle(gb);
+        return *gb->imm++;
+    }
+    return read_cycle(gb, gb->pc++);
+}
 u16 read_cycle16(GameBoy* gb, u16 addr) {
     u8 lo = read_cycle(gb, addr);
     u8 hi = read_cycle(gb, addr + 1);
@@ -42,25 +56,21 @@ u16 pop_cycle16(GameBoy* gb) {
 }
 
 u16 get_af(GameBoy* gb) {
-    return (gb->a << 8) + (gb->f_z << 7) + (gb->f_n << 6) + (gb->f_h << 5) +
-           (gb->f_c << 4);
+    return (gb->a << 8) + (flag_z(gb) << 7) + (gb->f_n << 6) +
+           (flag_h(gb) << 5) + (flag_c(gb) << 4);
 }
 void set_af(GameBoy* gb, u16 af) {
     gb->a = af >> 8;
-    gb->f_z = af & (1 << 7);
-    gb->f_n = af & (1 << 6);
-    gb->f_h = af & (1 << 5);
-    gb->f_c = af & (1 << 4);
+    set_flags(gb, af & (1 << 7), af & (1 << 6), af & (1 << 5), af & (1 << 4));
 }
 
-typedef void (*OpFuncPtr)(GameBoy*);
-
 // Used to compactly define families of opcodes for all possible registers
 #define DEF_ALL_REG(MACRO)                                                     \
     MACRO(a) MACRO(b) MACRO(c) MACRO(d) MACRO(e) MACRO(h) MACRO(l)
 #define DEF_ALL_REG16(MACRO) MACRO(bc) MACRO(de) MACRO(hl)
 #define DEF_ALL_COND(MACRO)                                                    \
-    MACRO(z, gb->f_z) MACRO(nz, !gb->f_z) MACRO(c, gb->f_c) MACRO(nc, !gb->f_c)
+    MACRO(z, flag_z(gb))                                                       \
+    MACRO(nz, !flag_z(gb)) MACRO(c, flag_c(gb)) MACRO(nc, !flag_c(gb))
 
 // LD r,r'
 #define LD_R_R(R1, R2)                                                         \
@@ -193,79 +203,91 @@ static void pop_af(GameBoy* gb) {
     set_af(gb, af);
 }
 
+// Flags of ADD SP, e and LD HL, SP+e, which come from the low byte
+static inline void sp_e_flags(GameBoy* gb, u8 e) {
+    u16 low = (gb->sp & 0xFF) + e;
+    gb->f_zres = 1;
+    gb->f_n = 0;
+    gb->f_hres = gb->sp ^ e ^ low;
+    gb->f_cres = low;
+}
+
 // LD HL, SP+e
 static void ld_hl_sp_e(GameBoy* gb) {
     u8 e = read_imm_cycle(gb);
-    gb->f_h = (gb->sp & 0xF) + (gb->e & 0xF) > 0xF;
-    gb->f_c = (gb->sp & 0xFF) + gb->e > 0xFF;
+    sp_e_flags(gb, e);
     gb->hl = gb->sp + (s8)e;
-    gb->f_z = 0;
-    gb->f_n = 0;
     cycle(gb);
 }
 
 // Helper operations for ALU operations
+// Flags are left for lazy evaluation, see flag_z() and friends in cpu.h
 static inline void alu_add(GameBoy* gb, u8 data) {
-    gb->f_h = (gb->a & 0xF) + (data & 0xF) > 0xF;
-    gb->f_c = gb->a + data > 0xFF;
-    gb->a += data;
-    gb->f_z = !gb->a;
+    u16 result = gb->a + data;
+    gb->f_hres = gb->a ^ data ^ result;
+    gb->f_cres = result;
+    gb->a = result;
+    gb->f_zres = gb->a;
     gb->f_n = 0;
 }
 
 static inline void alu_adc(GameBoy* gb, u8 data) {
-    gb->f_h = (gb->a & 0xF) + (data & 0xF) + gb->f_c > 0xF;
-    gb->f_c = gb->a + data + gb->f_c > 0xFF;
-    gb->a += data + gb->f_c;
-    gb->f_z = !gb->a;
+    u16 result = gb->a + data + flag_c(gb);
+    gb->f_hres = gb->a ^ data ^ result;
+    gb->f_cres = result;
+    gb->a = result;
+    gb->f_zres = gb->a;
     gb->f_n = 0;
 }
 
 static inline void alu_sub(GameBoy* gb, u8 data) {
-    gb->f_h = (gb->a & 0xF) < (data & 0xF);
-    gb->f_c = gb->a < data;
-    gb->a -= data;
-    gb->f_z = !gb->a;
+    u16 result = gb->a - data;
+    gb->f_hres = gb->a ^ data ^ result;
+    gb->f_cres = result;
+    gb->a = result;
+    gb->f_zres = gb->a;
     gb->f_n = 1;
 }
 
 static inline void alu_sbc(GameBoy* gb, u8 data) {
-    gb->f_h = (gb->a & 0xF) < (data & 0xF) + gb->f_c;
-    gb->f_c = gb->a < data + gb->f_c;
-    gb->a -= data + gb->f_c;
-    gb->f_z = !gb->a;
+    u16 result = gb->a - data - flag_c(gb);
+    gb->f_hres = gb->a ^ data ^ result;
+    gb->f_cres = result;
+    gb->a = result;
+    gb->f_zres = gb->a;
     gb->f_n = 1;
 }
 
 static inline void alu_cp(GameBoy* gb, u8 data) {
-    gb->f_z = gb->a == data;
+    u16 result = gb->a - data;
+    gb->f_hres = gb->a ^ data ^ result;
+    gb->f_cres = result;
+    gb->f_zres = result;
     gb->f_n = 1;
-    gb->f_h = (gb->a & 0xF) < (data & 0xF);
-    gb->f_c = gb->a < data;
 }
 
 static inline void alu_and(GameBoy* gb, u8 data) {
     gb->a &= data;
-    gb->f_z = !gb->a;
+    gb->f_zres = gb->a;
     gb->f_n = 0;
-    gb->f_h = 1;
-    gb->f_c = 0;
+    gb->f_hres = 0x10;
+    gb->f_cres = 0;
 }
 
 static inline void alu_or(GameBoy* gb, u8 data) {
     gb->a |= data;
-    gb->f_z = !gb->a;
+    gb->f_zres = gb->a;
     gb->f_n = 0;
-    gb->f_h = 0;
-    gb->f_c = 0;
+    gb->f_hres = 0;
+    gb->f_cres = 0;
 }
 
 static inline void alu_xor(GameBoy* gb, u8 data) {
     gb->a ^= data;
-    gb->f_z = !gb->a;
+    gb->f_zres = gb->a;
     gb->f_n = 0;
-    gb->f_h = 0;
-    gb->f_c = 0;
+    gb->f_hres = 0;
+    gb->f_cres = 0;
 }
 
 // Helper macros to generate ALU opcode implementations
@@ -300,66 +322,79 @@ DEF_ALU_OP (xor)
 // INC r
 #define INC_R(R)                                                               \
     static void inc_##R(GameBoy* gb) {                                         \
+        gb->f_hres = gb->R ^ (gb->R + 1);                                      \
         gb->R++;                                                               \
-        gb->f_z = !gb->R;                                                      \
+        gb->f_zres = gb->R;                                                    \
         gb->f_n = 0;                                                           \
-        gb->f_h = !(gb->R & 0xF);                                              \
     }
 DEF_ALL_REG(INC_R)
 
 // INC [HL] (function name avoids conflict with INC HL)
 static void inc_ahl(GameBoy* gb) {
     u8 data = read_cycle(gb, gb->hl);
+    gb->f_hres = data ^ (data + 1);
     data++;
-    gb->f_z = !data;
+    gb->f_zres = data;
     gb->f_n = 0;
-    gb->f_h = !(data & 0xF);
     write_cycle(gb, gb->hl, data);
 }
 
 // DEC r
 #define DEC_R(R)                                                               \
     static void dec_##R(GameBoy* gb) {                                         \
+        gb->f_hres = gb->R ^ (gb->R - 1);                                      \
         gb->R--;                                                               \
-        gb->f_z = !gb->R;                                                      \
+        gb->f_zres = gb->R;                                                    \
         gb->f_n = 1;                                                           \
-        gb->f_h = (gb->R & 0xF) == 0xF;                                        \
     }
 DEF_ALL_REG(DEC_R)
 
 // DEC [HL] (function name avoids conflict with DEC HL)
 static void dec_ahl(GameBoy* gb) {
     u8 data = read_cycle(gb, gb->hl);
+    gb->f_hres = data ^ (data - 1);
     data--;
-    gb->f_z = !data;
+    gb->f_zres = data;
     gb->f_n = 1;
-    gb->f_h = (data & 0xF) == 0xF;
     write_cycle(gb, gb->hl, data);
 }
 
 // CCF
 static void ccf(GameBoy* gb) {
     gb->f_n = 0;
-    gb->f_h = 0;
-    gb->f_c = !gb->f_c;
+    gb->f_hres = 0;
+    gb->f_cres ^= 0x100;
 }
 
 // SCF
 static void scf(GameBoy* gb) {
     gb->f_n = 0;
-    gb->f_h = 0;
-    gb->f_c = 1;
+    gb->f_hres = 0;
+    gb->f_cres = 0x100;
 }
 
 // DAA
-// To-do implement this
-static void daa(GameBoy* gb) { (void)gb; }
+static void daa(GameBoy* gb) {
+    u8 adjust = 0;
+    bool carry = flag_c(gb);
+    if (flag_h(gb) || (!gb->f_n && (gb->a & 0xF) > 9)) {
+        adjust |= 0x06;
+    }
+    if (carry || (!gb->f_n && gb->a > 0x99)) {
+        adjust |= 0x60;
+        carry = true;
+    }
+    gb->a = gb->f_n ? gb->a - adjust : gb->a + adjust;
+    gb->f_zres = gb->a;
+    gb->f_hres = 0;
+    gb->f_cres = carry << 8;
+}
 
 // CPL
 static void cpl(GameBoy* gb) {
     gb->a = ~gb->a;
     gb->f_n = 1;
-    gb->f_h = 1;
+    gb->f_hres = 0x10;
 }
 
 // INC rr
@@ -383,9 +418,10 @@ DEC_RR(sp)
 // ADD HL, rr
 #define ADD_HL_RR(RR)                                                          \
     static void add_hl_##RR(GameBoy* gb) {                                     \
-        gb->f_h = (gb->hl & 0xFFF) + (gb->RR & 0xFFF) > 0xFFF;                 \
-        gb->f_c = gb->hl + gb->RR > 0xFFF;                                     \
-        gb->hl += gb->RR;                                                      \
+        u32 result = gb->hl + gb->RR;                                          \
+        gb->f_hres = (gb->hl ^ gb->RR ^ result) >> 8;                          \
+        gb->f_cres = result >> 8;                                              \
+        gb->hl = result;                                                       \
         gb->f_n = 0;                                                           \
         cycle(gb);                                                             \
     }
@@ -395,109 +431,80 @@ ADD_HL_RR(sp)
 // ADD SP, e
 static void add_sp_e(GameBoy* gb) {
     u8 e = read_imm_cycle(gb);
-    gb->f_h = (gb->sp & 0xF) + (e & 0xF) > 0xF;
-    gb->f_c = (gb->sp & 0xFF) + e > 0xFF;
+    sp_e_flags(gb, e);
     gb->sp += (s8)e;
-    gb->f_z = 0;
-    gb->f_n = 0;
     cycle(gb);
     cycle(gb);
 }
 
 // RLCA
 static void rlca(GameBoy* gb) {
+    bool carry = gb->a & 0x80;
     gb->a = (gb->a << 1) + (gb->a >> 7);
-    gb->f_z = gb->f_n = gb->f_h = 0;
-    gb->f_c = gb->a & 0x01;
+    set_flags(gb, 0, 0, 0, carry);
 }
 
 // RRCA
 static void rrca(GameBoy* gb) {
+    bool carry = gb->a & 0x01;
     gb->a = (gb->a >> 1) + (gb->a << 7);
-    gb->f_z = gb->f_n = gb->f_h = 0;
-    gb->f_c = gb->a & 0x80;
+    set_flags(gb, 0, 0, 0, carry);
 }
 
 // RLA
 static void rla(GameBoy* gb) {
     bool carry = gb->a & 0x80;
-    gb->a = (gb->a << 1) + gb->f_c;
-    gb->f_c = carry;
-    gb->f_z = gb->f_n = gb->f_h = 0;
+    gb->a = (gb->a << 1) + flag_c(gb);
+    set_flags(gb, 0, 0, 0, carry);
 }
 
 // RRA
 static void rra(GameBoy* gb) {
     bool carry = gb->a & 0x01;
-    gb->a = (gb->a >> 1) + (gb->f_c << 7);
-    gb->f_c = carry;
-    gb->f_z = gb->f_n = gb->f_h = 0;
+    gb->a = (gb->a >> 1) + (flag_c(gb) << 7);
+    set_flags(gb, 0, 0, 0, carry);
 }
 
-// Helper functions for CB opcodes
-static inline u8 cb_rlc(GameBoy* gb, u8 data) {
-    data = (data << 1) + (data >> 7);
-    gb->f_z = !data;
-    gb->f_n = gb->f_h = 0;
-    gb->f_c = data & 0x01;
+// Helper functions for CB opcodes. The shifts and rotates all leave Z from
+// the result, N and H clear and C from the bit shifted out.
+static inline u8 shift_flags(GameBoy* gb, u8 data, bool carry) {
+    gb->f_zres = data;
+    gb->f_n = 0;
+    gb->f_hres = 0;
+    gb->f_cres = carry << 8;
     return data;
 }
 
+static inline u8 cb_rlc(GameBoy* gb, u8 data) {
+    return shift_flags(gb, (data << 1) + (data >> 7), data & 0x80);
+}
+
 static inline u8 cb_rrc(GameBoy* gb, u8 data) {
-    data = (data >> 1) + (data << 7);
-    gb->f_z = !data;
-    gb->f_n = gb->f_h = 0;
-    gb->f_c = data & 0x80;
-    return data;
+    return shift_flags(gb, (data >> 1) + (data << 7), data & 0x01);
 }
 
 static inline u8 cb_rl(GameBoy* gb, u8 data) {
-    bool carry = data & 0x80;
-    data = (data << 1) + gb->f_c;
-    gb->f_c = carry;
-    gb->f_z = !data;
-    gb->f_n = gb->f_h = 0;
-    return data;
+    return shift_flags(gb, (data << 1) + flag_c(gb), data & 0x80);
 }
 
 static inline u8 cb_rr(GameBoy* gb, u8 data) {
-    bool carry = data & 0x01;
-    data = (data >> 1) + (gb->f_c << 7);
-    gb->f_c = carry;
-    gb->f_z = !data;
-    gb->f_n = gb->f_h = 0;
-    return data;
+    return shift_flags(gb, (data >> 1) + (flag_c(gb) << 7), data & 0x01);
 }
 
 static inline u8 cb_sla(GameBoy* gb, u8 data) {
-    gb->f_c = data & 0x80;
-    data <<= 1;
-    gb->f_z = !data;
-    gb->f_n = gb->f_h = 0;
-    return data;
+    return shift_flags(gb, data << 1, data & 0x80);
 }
 
 static inline u8 cb_sra(GameBoy* gb, u8 data) {
-    gb->f_c = data & 0x01;
-    data = (data > 1) + (data & 0x80);
-    gb->f_z = !data;
-    gb->f_n = gb->f_h = 0;
-    return data;
+    return shift_flags(gb, (data >> 1) + (data & 0x80), data & 0x01);
 }
 
 static inline u8 cb_swap(GameBoy* gb, u8 data) {
-    data = (data << 4) + (data >> 4);
-    gb->f_z = !data;
-    gb->f_n = gb->f_h = gb->f_c = 0;
-    return data;
+    return shift_flags(gb, (data << 4) + (data >> 4), 0);
 }
 
 static inline u8 cb_srl(GameBoy* gb, u8 data) {
-    gb->f_c = data & 0x01;
-    data >>= 1;
-    gb->f_z = !data;
-    gb->f_n = gb->f_h = 0;
-    return data;
+    return shift_flags(gb, data >> 1, data & 0x01);
 }
 
 // Helper macros to generate CB opcode implementations
@@ -527,18 +534,18 @@ DEF_CB_OP(srl)
 // BIT b, r
 #define BIT_B_R(B, R)                                                          \
     static void bit_##B##_##R(GameBoy* gb) {                                   \
-        gb->f_z = !(gb->R & (1 << B));                                         \
+        gb->f_zres = gb->R & (1 << B);                                         \
         gb->f_n = 0;                                                           \
-        gb->f_h = 1;                                                           \
+        gb->f_hres = 0x10;                                                     \
     }
 
 // BIT b, [HL]
 #define BIT_B_HL(B)                                                            \
     static void bit_##B##_hl(GameBoy* gb) {                                    \
         u8 data = read_cycle(gb, gb->hl);                                      \
-        gb->f_z = !(data & (1 << B));                                          \
+        gb->f_zres = data & (1 << B);                                          \
         gb->f_n = 0;                                                           \
-        gb->f_h = 1;                                                           \
+        gb->f_hres = 0x10;                                                     \
     }
 
 // RES b, r
@@ -594,7 +601,7 @@ static void jp_hl(GameBoy* gb) { gb->pc = gb->hl; }
 
 // JP cc, nn
 // CC is used in generating the function name (i.e. "nz")
-// COND is used in the actual code (i.e. "!gb->f_z")
+// COND is used in the actual code (i.e. "!flag_z(gb)")
 #define JP_CC_NN(CC, COND)                                                     \
     static void jp_##CC##_nn(GameBoy* gb) {                                    \
         u16 nn = read_imm_cycle16(gb);                                         \
@@ -607,8 +614,12 @@ DEF_ALL_COND(JP_CC_NN)
 
 // JR e
 static void jr_e(GameBoy* gb) {
-    gb->pc += (s8)read_imm_cycle(gb);
+    s8 e = read_imm_cycle(gb);
+    gb->pc += e;
     cycle(gb);
+    if (e < 0) {
+        skip_idle_loop(gb, -e);
+    }
 }
 
 // JR cc, e
@@ -618,6 +629,9 @@ static void jr_e(GameBoy* gb) {
         if (COND) {                                                            \
             gb->pc += e;                                                       \
             cycle(gb);                                                         \
+            if (e < 0) {                                                       \
+                skip_idle_loop(gb, -e);                                        \
+            }                                                                  \
         }                                                                      \
     }
 DEF_ALL_COND(JR_CC_E)
@@ -681,15 +695,19 @@ RST_N(0x38)
 
 // HALT
 static void halt(GameBoy* gb) {
-    (void)gb;
-    printf("HALT not implemented yet!\n");
-    exit(1);
+    if (!gb->ime && (gb->ie & gb->if_)) {
+        // HALT bug: HALT is skipped and the next opcode byte is read twice
+        gb->halt_bug = true;
+    } else {
+        gb->halted = true;
+    }
 }
 
 // STOP
 static void stop(GameBoy* gb) {
     (void)gb;
     printf("STOP not implemented yet!\n");
+    trace_crash();
     exit(1);
 }
 
@@ -707,7 +725,7 @@ static void nop(GameBoy* gb) {
 
 // Arranged in octal for space reasons
 // clang-format off
-OpFuncPtr cb_ptrs[] = {
+static const OpFuncPtr cb_ptrs[] = {
 //             x0       x1       x2       x3       x4       x5        x6       x7
 /*  0x */   rlc_b,   rlc_c,   rlc_d,   rlc_e,   rlc_h,   rlc_l,   rlc_hl,   rlc_a,
 /*  1x */   rrc_b,   rrc_c,   rrc_d,   rrc_e,   rrc_h,   rrc_l,   rrc_hl,   rrc_a,
@@ -747,18 +765,25 @@ OpFuncPtr cb_ptrs[] = {
 static void op_cb(GameBoy* gb) {
     u8 opcode = read_imm_cycle(gb);
     OpFuncPtr func = cb_ptrs[opcode];
+#ifdef RONDO_PROFILE
+    u64 start = profile_ticks();
+    func(gb);
+    profile_cb(opcode, profile_ticks() - start);
+#else
     func(gb);
+#endif
 }
 
 static void op_ill(GameBoy* gb) {
     (void)gb;
     printf("Illegal opcode!\n");
+    trace_crash();
     exit(1);
 }
 
 // Arranged in octal for space reasons
 // clang-format off
-OpFuncPtr op_ptrs[] = {
+static const OpFuncPtr op_ptrs[] = {
 //                x0         x1        x2       x3          x4       x5       x6        x7
 /*  0x */        nop,  ld_bc_nn,  ld_bc_a,  inc_bc,      inc_b,   dec_b,  ld_b_n,     rlca,
 /*  1x */   ld_nn_sp, add_hl_bc,  ld_a_bc,  dec_bc,      inc_c,   dec_c,  ld_c_n,     rrca,
@@ -795,41 +820,245 @@ OpFuncPtr op_ptrs[] = {
 };
 // clang-format on
 
+// Instruction lengths in bytes, including the opcode
+// clang-format off
+const u8 op_lengths[256] = {
+//       x0 x1 x2 x3 x4 x5 x6 x7
+/*  0x */ 1, 3, 1, 1, 1, 1, 2, 1,
+/*  1x */ 3, 1, 1, 1, 1, 1, 2, 1,
+/*  2x */ 2, 3, 1, 1, 1, 1, 2, 1,
+/*  3x */ 2, 1, 1, 1, 1, 1, 2, 1,
+/*  4x */ 2, 3, 1, 1, 1, 1, 2, 1,
+/*  5x */ 2, 1, 1, 1, 1, 1, 2, 1,
+/*  6x */ 2, 3, 1, 1, 1, 1, 2, 1,
+/*  7x */ 2, 1, 1, 1, 1, 1, 2, 1,
+/* 10x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 11x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 12x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 13x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 14x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 15x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 16x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 17x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 20x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 21x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 22x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 23x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 24x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 25x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 26x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 27x */ 1, 1, 1, 1, 1, 1, 1, 1,
+/* 30x */ 1, 1, 3, 3, 3, 1, 2, 1,
+/* 31x */ 1, 1, 3, 2, 3, 3, 2, 1,
+/* 32x */ 1, 1, 3, 1, 3, 1, 2, 1,
+/* 33x */ 1, 1, 3, 1, 3, 1, 2, 1,
+/* 34x */ 2, 1, 1, 1, 1, 1, 2, 1,
+/* 35x */ 2, 1, 3, 1, 1, 1, 2, 1,
+/* 36x */ 2, 1, 1, 1, 1, 1, 2, 1,
+/* 37x */ 2, 1, 3, 1, 1, 1, 2, 1,
+};
+
+// Duration in M-cycles (conditional instructions: when not taken)
+const u8 op_cycles[256] = {
+//       x0 x1 x2 x3 x4 x5 x6 x7
+/*  0x */ 1, 3, 2, 2, 1, 1, 2, 1,
+/*  1x */ 5, 2, 2, 2, 1, 1, 2, 1,
+/*  2x */ 1, 3, 2, 2, 1, 1, 2, 1,
+/*  3x */ 3, 2, 2, 2, 1, 1, 2, 1,
+/*  4x */ 2, 3, 2, 2, 1, 1, 2, 1,
+/*  5x */ 2, 2, 2, 2, 1, 1, 2, 1,
+/*  6x */ 2, 3, 2, 2, 3, 3, 3, 1,
+/*  7x */ 2, 2, 2, 2, 1, 1, 2, 1,
+/* 10x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 11x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 12x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 13x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 14x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 15x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 16x */ 2, 2, 2, 2, 2, 2, 1, 2,
+/* 17x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 20x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 21x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 22x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 23x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 24x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 25x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 26x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 27x */ 1, 1, 1, 1, 1, 1, 2, 1,
+/* 30x */ 2, 3, 3, 4, 3, 4, 2, 4,
+/* 31x */ 2, 4, 3, 1, 3, 6, 2, 4,
+/* 32x */ 2, 3, 3, 1, 3, 4, 2, 4,
+/* 33x */ 2, 4, 3, 1, 3, 1, 2, 4,
+/* 34x */ 3, 3, 2, 1, 1, 4, 2, 4,
+/* 35x */ 4, 1, 4, 1, 1, 1, 2, 4,
+/* 36x */ 3, 3, 2, 1, 1, 4, 2, 4,
+/* 37x */ 3, 2, 4, 1, 1, 1, 2, 4,
+};
+// clang-format on
+
+OpFuncPtr op_handler(u8 opcode) { return op_ptrs[opcode]; }
+OpFuncPtr cb_handler(u8 opcode) { return cb_ptrs[opcode]; }
+
+// CB opcodes take 2 M-cycles including the prefix, plus 2 to read and write
+// back [HL] (only 1 for BIT, which doesn't write)
+u8 cb_cycles(u8 opcode) {
+    if ((opcode & 0x07) != 6) {
+        return 2;
+    }
+    return (opcode & 0xC0) == 0x40 ? 3 : 4;
+}
+
+static void service_interrupt(GameBoy* gb) {
+    gb->ime = false;
+    cycle(gb);
+    push_cycle16(gb, gb->pc);
+
+    if (gb->ie & gb->if_ & (1 << 0)) {
+        // V-Blank interrupt
+        gb->if_ &= ~(1 << 0);
+        gb->pc = 0x40;
+    } else if (gb->ie & gb->if_ & (1 << 1)) {
+        // LCD/STAT interrupt
+        gb->if_ &= ~(1 << 1);
+        gb->pc = 0x48;
+    } else if (gb->ie & gb->if_ & (1 << 2)) {
+        // Timer interrupt
+        gb->if_ &= ~(1 << 2);
+        gb->pc = 0x50;
+    } else if (gb->ie & gb->if_ & (1 << 3)) {
+        // Serial interrupt
+        gb->if_ &= ~(1 << 3);
+        gb->pc = 0x58;
+    } else if (gb->ie & gb->if_ & (1 << 4)) {
+        // Joypad interrupt
+        gb->if_ &= ~(1 << 4);
+        gb->pc = 0x60;
+    }
+    cycle(gb);
+}
+
 void run_opcode(GameBoy* gb) {
-    // Handle interrupts
-    if (gb->ime && (gb->ie & gb->if_)) {
-        // At least one pending interrupt
-        gb->ime = false;
-        cycle(gb);
-        push_cycle16(gb, gb->pc);
-
-        if (gb->ie & gb->if_ & (1 << 0)) {
-            // V-Blank interrupt
-            gb->if_ &= ~(1 << 0);
-            gb->pc = 0x40;
-        } else if (gb->ie & gb->if_ & (1 << 1)) {
-            // LCD/STAT interrupt
-            gb->if_ &= ~(1 << 1);
-            gb->pc = 0x48;
-        } else if (gb->ie & gb->if_ & (1 << 2)) {
-            // Timer interrupt
-            gb->if_ &= ~(1 << 2);
-            gb->pc = 0x50;
-        } else if (gb->ie & gb->if_ & (1 << 3)) {
-            // Serial interrupt
-            gb->if_ &= ~(1 << 3);
-            gb->pc = 0x58;
-        } else if (gb->ie & gb->if_ & (1 << 4)) {
-            // Joypad interrupt
-            gb->if_ &= ~(1 << 4);
-            gb->pc = 0x60;
+    if (gb->halted) {
+        if (!(gb->ie & gb->if_)) {
+            // Nothing can wake the CPU before the next event
+            skip_to_next_event(gb);
+            return;
         }
-        cycle(gb);
+        gb->halted = false;
+    }
 
+    if (interrupt_pending(gb)) {
+        service_interrupt(gb);
         return;
     }
 
-    u8 opcode = read_imm_cycle(gb);
+#ifdef RONDO_TRACE
+    trace_op(gb);
+#endif
+    u8 opcode;
+#ifdef RONDO_PROFILE
+    u16 pc = gb->pc;
+#endif
+    if (gb->halt_bug) {
+        opcode = read_cycle(gb, gb->pc);
+        gb->halt_bug = false;
+    } else {
+        opcode = read_imm_cycle(gb);
+    }
     OpFuncPtr func = op_ptrs[opcode];
+#ifdef RONDO_PROFILE
+    u64 start = profile_ticks();
     func(gb);
-}
\ No newline at end of file
+    profile_op(gb, pc, opcode, profile_ticks() - start);
+#else
+    func(gb);
+#endif
+}
+
+// Profiling and tracing need every instruction to go through run_opcode
+#if defined(RONDO_PROFILE) || defined(RONDO_TRACE)
+#define RONDO_RUN_OPCODE_ONLY
+#endif
+
+#if defined(RONDO_THREADED_DISPATCH) && defined(__GNUC__) &&                   \
+    !defined(RONDO_RUN_OPCODE_ONLY)
+// Expands MACRO once for every opcode from 0x00 to 0xFF
+#define HEX16(MACRO, H)                                                        \
+    MACRO(0x##H##0) MACRO(0x##H##1) MACRO(0x##H##2) MACRO(0x##H##3)            \
+    MACRO(0x##H##4) MACRO(0x##H##5) MACRO(0x##H##6) MACRO(0x##H##7)            \
+    MACRO(0x##H##8) MACRO(0x##H##9) MACRO(0x##H##A) MACRO(0x##H##B)            \
+    MACRO(0x##H##C) MACRO(0x##H##D) MACRO(0x##H##E) MACRO(0x##H##F)
+#define HEX256(MACRO)                                                          \
+    HEX16(MACRO, 0) HEX16(MACRO, 1) HEX16(MACRO, 2) HEX16(MACRO, 3)            \
+    HEX16(MACRO, 4) HEX16(MACRO, 5) HEX16(MACRO, 6) HEX16(MACRO, 7)            \
+    HEX16(MACRO, 8) HEX16(MACRO, 9) HEX16(MACRO, A) HEX16(MACRO, B)            \
+    HEX16(MACRO, C) HEX16(MACRO, D) HEX16(MACRO, E) HEX16(MACRO, F)
+
+#define OP_LABEL(N) &&op_##N,
+#define CB_LABEL(N) &&cb_##N,
+
+// Common case of the dispatch, repeated at the end of every opcode body so
+// that each one gets its own indirect branch
+#define DISPATCH()                                                             \
+    if (gb->end_frame || interrupt_pending(gb)) {                              \
+        goto check;                                                            \
+    }                                                                          \
+    goto* op_labels[read_imm_cycle(gb)];
+
+// The handlers are looked up from constant tables with constant indices, so
+// the compiler turns each call into a direct one and inlines it. HALT always
+// goes back through run_opcode.
+#define OP_BODY(N)                                                             \
+    op_##N : if (N == 0xCB) {                                                  \
+        goto* cb_labels[read_imm_cycle(gb)];                                   \
+    }                                                                          \
+    op_ptrs[N](gb);                                                            \
+    if (N == 0x76) {                                                           \
+        goto check;                                                            \
+    }                                                                          \
+    DISPATCH()
+#define CB_BODY(N)                                                             \
+    cb_##N : cb_ptrs[N](gb);                                                   \
+    DISPATCH()
+
+// Threaded interpreter using labels as values (GCC/Clang only)
+static void interpret(GameBoy* gb) {
+    static void* const op_labels[256] = {HEX256(OP_LABEL)};
+    static void* const cb_labels[256] = {HEX256(CB_LABEL)};
+
+check:
+    if (gb->end_frame) {
+        return;
+    }
+    if (needs_run_opcode(gb)) {
+        run_opcode(gb);
+        goto check;
+    }
+    goto* op_labels[read_imm_cycle(gb)];
+
+    HEX256(OP_BODY)
+    HEX256(CB_BODY)
+}
+#else
+// Portable function pointer dispatch
+static void interpret(GameBoy* gb) {
+    while (!gb->end_frame) {
+        run_opcode(gb);
+    }
+}
+#endif
+
+void run_opcodes(GameBoy* gb) {
+#ifdef RONDO_RUN_OPCODE_ONLY
+    // Blocks and compiled code don't go through run_opcode
+    interpret(gb);
+#else
+    if (gb->jit) {
+        run_jit(gb);
+    } else if (gb->blocks) {
+        run_blocks(gb);
+    } else {
+        interpret(gb);
+    }
+#endif
+}
@@ -1,8 +1,16 @@
 #include "gb.h"
+#include "apu.h"
+#include "block.h"
+#include "jit.h"
 #include "cpu.h"
 #include "lcd.h"
+#include "mbc.h"
+#include "rewind.h"
+#include "timer.h"
+#include "trace.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
 
 // Critical memory allocation, abort on failure
 void* crit_alloc(size_t size) {
@@ -14,6 +22,36 @@ void* crit_alloc(size_t size) {
     return ptr;
 }
 
+// Points the pages covering [addr, addr + size) at consecutive 256-byte
+// chunks of mem (or routes them to the slow path if mem is NULL)
+void map_pages(u8** map, u16 addr, u16 size, u8* mem) {
+    for (int i = 0; i < size / 0x100; i++) {
+        map[(addr >> 8) + i] = mem ? mem + 0x100 * i : NULL;
+    }
+}
+
+// Rebuilds both page tables from the current region pointers
+void map_memory(GameBoy* gb) {
+    memset(gb->read_map, 0, sizeof(gb->read_map));
+    memset(gb->write_map, 0, sizeof(gb->write_map));
+
+    // ROM and cartridge RAM banks
+    mbc_map(gb);
+    map_pages(gb->read_map, 0x8000, 0x2000, gb->vram);
+    // Tile data writes need to invalidate the tile cache, so only the tile
+    // maps can be written directly
+    map_pages(gb->write_map, 0x9800, 0x0800, gb->vram + 0x1800);
+
+    // WRAM and its echo at 0xE000-0xFDFF
+    u8** maps[] = {gb->read_map, gb->write_map};
+    for (int i = 0; i < 2; i++) {
+        map_pages(maps[i], 0xC000, 0x1000, gb->wram_lo);
+        map_pages(maps[i], 0xD000, 0x1000, gb->wram_hi);
+        map_pages(maps[i], 0xE000, 0x1000, gb->wram_lo);
+        map_pages(maps[i], 0xF000, 0x0E00, gb->wram_hi);
+    }
+}
+
 GameBoy* make_gb(u8* rom, size_t size) {
     if (size < 0x8000) {
         printf("File must be at least 0x8000 bytes\n");
@@ -52,23 +90,19 @@ GameBoy* make_gb(u8* rom, size_t size) {
     gb->wram_hi = gb->wram_lo + 0x1000;
     gb->oam = crit_alloc(0xA0);
     gb->hram = crit_alloc(0x7F);
+    gb->tile_cache = crit_alloc(384 * 64);
+    memset(gb->tile_dirty, true, sizeof(gb->tile_dirty));
 
     // Cartridge stuff
-    if (rom[0x147] != 0x00) {
-        printf("Only standard (no mapper) carts supported right now");
-        exit(1);
+    if (!mbc_init(gb, rom, size)) {
+        destroy_gb(gb);
+        return NULL;
     }
-    gb->rom_lo = rom;
-    gb->rom_hi = rom + 0x4000;
-    gb->cartram = NULL;
 
     // Initialize registers
     // (TODO: Make these actually correct later;)
     gb->a = 0;
-    gb->f_z = false;
-    gb->f_n = false;
-    gb->f_h = false;
-    gb->f_c = false;
+    set_flags(gb, false, false, false, false);
     gb->bc = 0;
     gb->de = 0;
     gb->hl = 0;
@@ -79,27 +113,72 @@ GameBoy* make_gb(u8* rom, size_t size) {
 
     gb->lcd_en = true;
 
+    // Sound is left on, at full volume on both sides, by the boot ROM
+    gb->apu_on = true;
+    gb->nr[0x14] = 0x77;
+    gb->nr[0x15] = 0xF3;
+
+    // Plain grey ARGB until the frontend says otherwise
+    u32 grey[4] = {0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000};
+    memcpy(gb->palette, grey, sizeof(grey));
+
+    map_memory(gb);
+
+    // Nothing is scheduled until the components below ask for it
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        gb->events[i] = NEVER;
+    }
+    gb->next_event = NEVER;
+    lcd_sync(gb);
+    apu_div_reset(gb, false);
+
     return gb;
 }
 
 void destroy_gb(GameBoy* gb) {
     free(gb->vram);
-    free(gb->cartram);
+    if (!gb->sram_attached) {
+        free(gb->sram);
+    }
     free(gb->wram_lo);
     free(gb->oam);
     free(gb->hram);
+    free(gb->tile_cache);
+    free_block_cache(gb);
+    free_jit(gb);
+    free_rewind(gb);
+    free_audio(gb);
     free(gb);
 }
 
 void run_frame(GameBoy* gb) {
-    while (!gb->end_frame) {
-        // if (gb->pc == 0x2E4) {
-        //     printf("Reached\n");
-        //     exit(1);
-        // }
-        run_opcode(gb);
-    }
+    run_opcodes(gb);
+    apu_sync(gb);
     gb->end_frame = false;
+    if (gb->rewind) {
+        rewind_push(gb);
+    }
+}
+
+// Held buttons in the groups selected by P1, in the order of its low bits
+static u8 p1_pressed(GameBoy* gb) {
+    u8 pressed = 0;
+    if (!(gb->p1_sel & 0x10)) {
+        pressed |= gb->buttons & 0x0F;
+    }
+    if (!(gb->p1_sel & 0x20)) {
+        pressed |= gb->buttons >> 4;
+    }
+    return pressed;
+}
+
+void set_buttons(GameBoy* gb, u8 buttons) {
+    u8 before = p1_pressed(gb);
+    gb->buttons = buttons;
+    if (p1_pressed(gb) & ~before) {
+        // Joypad interrupt on a P1 line going low
+        gb->if_ |= (1 << 4);
+    }
 }
 
 u8 io_read(GameBoy* gb, u16 addr) {
@@ -107,24 +186,21 @@ u8 io_read(GameBoy* gb, u16 addr) {
 
     // Audio registers
     if (0x10 <= addr && addr <= 0x3f) {
-        return 0x00;
+        return apu_read(gb, addr);
     }
 
     switch (addr) {
     case 0x00: // P1 (FF00)
-        return 0xFF;
+        return 0xC0 | gb->p1_sel | (~p1_pressed(gb) & 0x0F);
     case 0x01: // SB (FF01)
         return gb->sb;
     case 0x02: // SC (FF02)
         return gb->sc;
     case 0x04: // DIV (FF04)
-        return gb->div >> 8;
     case 0x05: // TIMA (FF05)
-        return gb->tima;
     case 0x06: // TMA (FF06)
-        return gb->tma;
     case 0x07: // TAC (FF07)
-        return (gb->tac_en << 2) | gb->tac_clk | 0xF8;
+        return timer_read(gb, addr);
     case 0x0F: // IF (FF0F)
         return gb->if_;
     case 0x40: // LCDC (FF40)
@@ -132,7 +208,7 @@ u8 io_read(GameBoy* gb, u16 addr) {
                (gb->tile_sel << 4) | (gb->bg_map << 3) | (gb->obj_size << 2) |
                (gb->obj_en << 1) | (gb->bg_en << 0);
     case 0x41: // STAT (FF41)
-        return gb->stat;
+        return lcd_read_stat(gb);
     case 0x42: // SCY (FF42)
         return gb->scy;
     case 0x43: // SCX (FF43)
@@ -158,11 +234,13 @@ u8 io_read(GameBoy* gb, u16 addr) {
         return gb->wx;
     default:
         printf("Unimplemented read at IO address %x\n", (int)addr);
+        trace_crash();
         exit(1);
     }
 }
 
-u8 read(GameBoy* gb, u16 addr) {
+// Handles regions without a direct page in read_map
+static u8 read_slow(GameBoy* gb, u16 addr) {
     if (addr < 0x8000) {
         // 0x0000 - 0x7FFF (ROM)
         u8* ptr = (addr & 0x4000) ? gb->rom_hi : gb->rom_lo;
@@ -172,8 +250,7 @@ u8 read(GameBoy* gb, u16 addr) {
         return gb->vram[addr % 0x2000];
     } else if (addr < 0xC000) {
         // 0xA000 - 0xBFFF (External RAM)
-        // TODO: implement external RAM
-        return 0xFF;
+        return mbc_read_ram(gb, addr);
     } else if (addr < 0xFE00) {
         // 0xC000 - 0xFDFF (WRAM)
         // Designed to account for echo RAM
@@ -201,35 +278,42 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
 
     // Audio registers
     if (0x10 <= addr && addr <= 0x3f) {
+        apu_write(gb, addr, data);
         return;
     }
 
     switch (addr) {
     case 0x00: // P1 (FF00)
+        gb->p1_sel = data & 0x30;
         break;
     case 0x01: // SB (FF01)
         gb->sb = data;
         break;
     case 0x02: // SC (FF02)
         gb->sc = data;
+        if ((data & 0x81) == 0x81) {
+            // Transfer with internal clock: 8 bits at 8192 Hz
+            schedule(gb, EVENT_SERIAL, gb->cycles + 8 * 512);
+        } else {
+            schedule(gb, EVENT_SERIAL, NEVER);
+        }
         break;
     case 0x04: // DIV (FF04)
-        gb->div = 0;
-        break;
     case 0x05: // TIMA (FF05)
-        gb->tima = data;
-        break;
     case 0x06: // TMA (FF06)
-        gb->tma = data;
-        break;
     case 0x07: // TAC (FF07)
-        gb->tac_en = data & (1 << 2);
-        gb->tac_clk = data & 0x3;
+        timer_write(gb, addr, data);
         break;
     case 0x0F: // IF (FF0F)
         gb->if_ = data & 0x1F;
         break;
     case 0x40: // LCDC (FF40)
+        // Catch up under the old setting, then resume or freeze the PPU
+        lcd_sync(gb);
+        if (!gb->lcd_en && (data & (1 << 7))) {
+            // Resumes from the present, not from the last frame end
+            gb->lcd_time = gb->cycles;
+        }
         gb->lcd_en = data & (1 << 7);
         gb->win_map = data & (1 << 6);
         gb->win_en = data & (1 << 5);
@@ -238,6 +322,7 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
         gb->obj_size = data & (1 << 2);
         gb->obj_en = data & (1 << 1);
         gb->bg_en = data & (1 << 0);
+        lcd_sync(gb);
         break;
     case 0x41: // STAT (FF41)
         gb->stat = data;
@@ -286,21 +371,29 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
     default:
         printf("Unimplemented write %x at IO address %x\n", (int)data,
                (int)addr);
+        trace_crash();
         exit(1);
     }
 }
 
-void write(GameBoy* gb, u16 addr, u8 data) {
+// Handles regions without a direct page in write_map
+static void write_slow(GameBoy* gb, u16 addr, u8 data) {
     if (addr < 0x8000) {
         // 0x0000 - 0x7FFF (ROM)
+        mbc_write(gb, addr, data);
     } else if (addr < 0xA000) {
         // 0x8000 - 0x9FFF (VRAM)
         gb->vram[addr % 0x2000] = data;
+        if (addr < 0x9800) {
+            gb->tile_dirty[(addr % 0x2000) / 16] = true;
+        }
     } else if (addr < 0xC000) {
         // 0xA000 - 0xBFFF (External RAM)
-        // TODO: implement external RAM
+        mbc_write_ram(gb, addr, data);
     } else if (addr < 0xFE00) {
         // 0xC000 - 0xFDFF (WRAM)
+        // Only reached for pages holding cached code
+        block_invalidate_page(gb, addr);
         // Designed to account for echo RAM
         u8* ptr = (addr & 0x1000) ? gb->wram_hi : gb->wram_lo;
         ptr[addr & 0x0FFF] = data;
@@ -321,11 +414,79 @@ void write(GameBoy* gb, u16 addr, u8 data) {
     }
 }
 
-void cycle(GameBoy* gb) {
-    gb->cycles += 2;
-    if (gb->lcd_en) {
-        for (int i = 0; i < 4; i++) {
-            lcd_cycle(gb);
+u8 read(GameBoy* gb, u16 addr) {
+    u8* page = gb->read_map[addr >> 8];
+    if (page) {
+        return page[addr & 0xFF];
+    }
+    return read_slow(gb, addr);
+}
+
+void write(GameBoy* gb, u16 addr, u8 data) {
+    u8* page = gb->write_map[addr >> 8];
+    if (page) {
+        page[addr & 0xFF] = data;
+        return;
+    }
+    write_slow(gb, addr, data);
+}
+
+void schedule(GameBoy* gb, EventType type, u64 when) {
+    gb->events[type] = when;
+    gb->next_event = NEVER;
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        if (gb->events[i] < gb->next_event) {
+            gb->next_event = gb->events[i];
         }
     }
 }
+
+// No link cable partner, so every transfer shifts in 0xFF
+static void serial_complete(GameBoy* gb) {
+    gb->sb = 0xFF;
+    gb->sc &= ~(1 << 7);
+    gb->if_ |= (1 << 3);
+    schedule(gb, EVENT_SERIAL, NEVER);
+}
+
+static void run_events(GameBoy* gb) {
+    if (gb->events[EVENT_LCD] <= gb->cycles) {
+        lcd_sync(gb);
+    }
+    if (gb->events[EVENT_SERIAL] <= gb->cycles) {
+        serial_complete(gb);
+    }
+    if (gb->events[EVENT_TIMER] <= gb->cycles) {
+        timer_reload(gb);
+    }
+    if (gb->events[EVENT_APU] <= gb->cycles) {
+        apu_step(gb);
+    }
+}
+
+// Advances time by one M-cycle, handling any events that fall due
+void cycle(GameBoy* gb) {
+    gb->cycles += 4;
+    if (gb->cycles >= gb->next_event) {
+        run_events(gb);
+    }
+}
+
+// Returns the cycle at which the IO register at addr will next change on
+// its own, outside of any event
+u64 io_next_change(GameBoy* gb, u16 addr) {
+    if (addr == 0xFF04 || addr == 0xFF05) {
+        return timer_next_change(gb, addr);
+    }
+    // LY, STAT and IF only ever change in events
+    return NEVER;
+}
+
+// Advances time to the M-cycle in which the next event falls due, as if
+// cycle() had been called repeatedly
+void skip_to_next_event(GameBoy* gb) {
+    if (gb->next_event != NEVER) {
+        gb->cycles += (gb->next_event - gb->cycles - 1) / 4 * 4;
+    }
+    cycle(gb);
+}
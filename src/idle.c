@@ -0,0 +1,158 @@
+#include "idle.h"
+#include "cpu.h"
+
+// Longest loop (in bytes, including the JR) that gets analysed
+#define IDLE_MAX_LENGTH 16
+
+// The only state a polling loop is allowed to modify
+typedef struct {
+    u8 a;
+    bool f_z, f_n, f_h, f_c;
+} LoopState;
+
+// Registers that only change when an event runs or at io_next_change
+static bool is_polled_io(u16 addr) {
+    switch (addr) {
+    case 0xFF04: // DIV
+    case 0xFF05: // TIMA
+    case 0xFF0F: // IF
+    case 0xFF41: // STAT
+    case 0xFF44: // LY
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Gives the same A and (evaluated) flags as alu_and/or/xor/cp in cpu.c
+static void loop_alu(LoopState* s, u8 op, u8 data) {
+    switch (op) {
+    case 0xA7: // AND A
+    case 0xE6: // AND n
+        s->a &= data;
+        s->f_z = !s->a;
+        s->f_n = 0;
+        s->f_h = 1;
+        s->f_c = 0;
+        break;
+    case 0xB7: // OR A
+    case 0xF6: // OR n
+    case 0xEE: // XOR n
+        s->a = op == 0xEE ? s->a ^ data : s->a | data;
+        s->f_z = !s->a;
+        s->f_n = 0;
+        s->f_h = 0;
+        s->f_c = 0;
+        break;
+    case 0xFE: // CP n
+        s->f_z = s->a == data;
+        s->f_n = 1;
+        s->f_h = (s->a & 0xF) < (data & 0xF);
+        s->f_c = s->a < data;
+        break;
+    }
+}
+
+void skip_idle_loop(GameBoy* gb, u8 length) {
+    u16 head = gb->pc;
+    u16 jr_pc = head + length - 2;
+    if (length > IDLE_MAX_LENGTH || (head >> 8) != ((jr_pc + 1) >> 8) ||
+        gb->end_frame || needs_run_opcode(gb)) {
+        return;
+    }
+    const u8* page = gb->read_map[head >> 8];
+    if (!page) {
+        return;
+    }
+    const u8* code = page + (head & 0xFF);
+
+    // Run one iteration on the side, reading the registers as they are now.
+    // Their values hold until limit, so if the iteration leaves the state
+    // unchanged then so will every one after it up to there.
+    LoopState s = {gb->a, flag_z(gb), gb->f_n, flag_h(gb), flag_c(gb)};
+    u64 limit = gb->next_event;
+    unsigned cycles = 0;
+    int i = 0;
+    while (i < length - 2) {
+        u8 op = code[i];
+        u16 addr;
+        switch (op) {
+        case 0x00: // NOP
+            cycles += 1;
+            break;
+        case 0xF0: // LDH A, [n]
+        case 0xFA: // LD A, [nn]
+            addr = op == 0xF0 ? 0xFF00 + code[i + 1]
+                              : code[i + 1] | code[i + 2] << 8;
+            if (!is_polled_io(addr)) {
+                return;
+            }
+            s.a = read(gb, addr);
+            u64 change = io_next_change(gb, addr);
+            if (change < limit) {
+                limit = change;
+            }
+            cycles += op_cycles[op];
+            break;
+        case 0xA7: // AND A
+        case 0xB7: // OR A
+            loop_alu(&s, op, s.a);
+            cycles += 1;
+            break;
+        case 0xE6: // AND n
+        case 0xF6: // OR n
+        case 0xEE: // XOR n
+        case 0xFE: // CP n
+            loop_alu(&s, op, code[i + 1]);
+            cycles += 2;
+            break;
+        case 0xCB: // BIT b, A
+            if ((code[i + 1] & 0xC7) != 0x47) {
+                return;
+            }
+            s.f_z = !(s.a & (1 << ((code[i + 1] >> 3) & 7)));
+            s.f_n = 0;
+            s.f_h = 1;
+            cycles += cb_cycles(code[i + 1]);
+            break;
+        default:
+            return;
+        }
+        i += op_lengths[op];
+    }
+    if (i != length - 2) {
+        // Last instruction runs into the JR
+        return;
+    }
+
+    bool taken;
+    switch (code[i]) {
+    case 0x18: // JR e
+        taken = true;
+        break;
+    case 0x20: // JR NZ, e
+        taken = !s.f_z;
+        break;
+    case 0x28: // JR Z, e
+        taken = s.f_z;
+        break;
+    case 0x30: // JR NC, e
+        taken = !s.f_c;
+        break;
+    case 0x38: // JR C, e
+        taken = s.f_c;
+        break;
+    default:
+        return;
+    }
+    if (!taken || s.a != gb->a || s.f_z != flag_z(gb) || s.f_n != gb->f_n ||
+        s.f_h != flag_h(gb) || s.f_c != flag_c(gb) || limit == NEVER) {
+        return;
+    }
+
+    // Skip whole iterations, stopping short of the cycle where limit hits
+    u64 period = 4 * (cycles + op_cycles[0x18]);
+    if (gb->cycles + period < limit) {
+        gb->cycles += (limit - gb->cycles - 1) / period * period;
+    }
+}
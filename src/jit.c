@@ -0,0 +1,1407 @@
+#include "jit.h"
+#include "block.h"
+#include "cpu.h"
+#include "idle.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+// x86-64 translation of hot SM83 blocks. Register and ALU ops, loads and
+// stores, the stack and CB ops are translated, up to a final jump, call or
+// return, and only from ROM, so there is nothing to invalidate. Memory goes
+// straight through read_map/write_map and HRAM. An access anywhere else (IO,
+// OAM, tile data, MBC registers, RAM holding code) takes a side exit before
+// the instruction runs, and that instruction, like everything that isn't
+// translated, runs from the block cache instead.
+
+#if defined(RONDO_JIT) && (defined(__x86_64__) || defined(_M_X64))
+
+#ifdef _WIN32
+#include "windows.h"
+#else
+#include "sys/mman.h"
+#endif
+
+#define JIT_CACHE_SIZE 4096
+#define JIT_CODE_SIZE (1 << 20)
+// Largest translation of a single instruction, side exit included, in bytes
+#define JIT_MAX_OP_BYTES 192
+#define JIT_MAX_OPS 32
+// Each memory access can exit on the page lookup and on the range check
+#define JIT_MAX_EXITS (2 * JIT_MAX_OPS)
+// Times a block has to be reached before it is translated
+#define JIT_HOT_THRESHOLD 8
+
+typedef void (*JitFunc)(GameBoy*);
+
+typedef enum { JIT_COLD, JIT_COMPILED, JIT_UNSUPPORTED } JitState;
+
+typedef struct {
+    u16 pc;
+    // Host page the block was translated from, identifies the ROM bank
+    u8* page;
+    u8 state;
+    u8 hits;
+    // Number of instructions
+    u8 count;
+    // Duration in M-cycles when the final branch is taken, and when it isn't
+    // (or there is none)
+    u8 max_cycles;
+    u8 min_cycles;
+    // Side exits taken, less runs that made it to the end
+    u8 bails;
+    // Length of the loop closed by a final JR back to loop_pc, or 0
+    u8 loop_length;
+    u16 loop_pc;
+    JitFunc code;
+} JitBlock;
+
+struct JitCache {
+    JitBlock blocks[JIT_CACHE_SIZE];
+    u8* code;
+    size_t code_used;
+};
+
+// Flags as bits, in the same positions as in F (shifted down by 4)
+#define FLAG_Z 8
+#define FLAG_N 4
+#define FLAG_H 2
+#define FLAG_C 1
+#define FLAG_ALL 15
+
+// x86 registers (by number, so AL also stands for AX and EAX) and condition
+// codes used by the translations
+#define AL 0
+#define CL 1
+#define DL 2
+#define CC_C 2
+#define CC_NC 3
+#define CC_Z 4
+#define CC_NZ 5
+
+// Offset of a GameBoy field from the base register (r11)
+#define OFF(FIELD) ((u32)offsetof(GameBoy, FIELD))
+
+// Offsets of B, C, D, E, H, L, [HL], A, in SM83 register encoding order
+static const u32 reg_offsets[8] = {OFF(b), OFF(c), OFF(d), OFF(e),
+                                   OFF(h), OFF(l), 0,      OFF(a)};
+
+// Offsets of BC, DE, HL, SP, in SM83 register encoding order
+static const u32 pair_offsets[4] = {OFF(bc), OFF(de), OFF(hl), OFF(sp)};
+
+// A jump to a side exit, to be pointed at its stub once the block is done
+typedef struct {
+    u8* patch;
+    u16 pc;
+    u32 cycles;
+} JitExit;
+
+typedef struct {
+    u8* p;
+    // Where a side exit taken now resumes, and the M-cycles spent before it
+    u16 pc;
+    u32 cycles;
+    JitExit exits[JIT_MAX_EXITS];
+    int exit_count;
+} Emitter;
+
+static void emit8(Emitter* e, u8 byte) { *e->p++ = byte; }
+
+static void emit16(Emitter* e, u16 data) {
+    emit8(e, data & 0xFF);
+    emit8(e, data >> 8);
+}
+
+static void emit32(Emitter* e, u32 data) {
+    emit16(e, data & 0xFFFF);
+    emit16(e, data >> 16);
+}
+
+// Points the rel32 at p to target
+static void patch32(u8* p, u8* target) {
+    u32 rel = (u32)(target - (p + 4));
+    for (int i = 0; i < 4; i++) {
+        p[i] = rel >> (i * 8);
+    }
+}
+
+// ModRM for [r11 + disp32], with reg (or opcode extension) in the middle
+static void emit_mem(Emitter* e, u8 reg, u32 off) {
+    emit8(e, 0x80 | (reg << 3) | 3);
+    emit32(e, off);
+}
+
+// mov r8, [gb + off]
+static void emit_load8(Emitter* e, u8 reg, u32 off) {
+    emit8(e, 0x41);
+    emit8(e, 0x8A);
+    emit_mem(e, reg, off);
+}
+
+// mov [gb + off], r8
+static void emit_store8(Emitter* e, u8 reg, u32 off) {
+    emit8(e, 0x41);
+    emit8(e, 0x88);
+    emit_mem(e, reg, off);
+}
+
+// movzx r32, word [gb + off]
+static void emit_load16(Emitter* e, u8 reg, u32 off) {
+    emit8(e, 0x41);
+    emit8(e, 0x0F);
+    emit8(e, 0xB7);
+    emit_mem(e, reg, off);
+}
+
+// mov [gb + off], r16
+static void emit_store16(Emitter* e, u8 reg, u32 off) {
+    emit8(e, 0x66);
+    emit8(e, 0x41);
+    emit8(e, 0x89);
+    emit_mem(e, reg, off);
+}
+
+// mov byte [gb + off], imm8
+static void emit_store_imm8(Emitter* e, u32 off, u8 imm) {
+    emit8(e, 0x41);
+    emit8(e, 0xC6);
+    emit_mem(e, 0, off);
+    emit8(e, imm);
+}
+
+// mov word [gb + off], imm16
+static void emit_store_imm16(Emitter* e, u32 off, u16 imm) {
+    emit8(e, 0x66);
+    emit8(e, 0x41);
+    emit8(e, 0xC7);
+    emit_mem(e, 0, off);
+    emit16(e, imm);
+}
+
+// inc/dec word [gb + off]
+static void emit_incdec16(Emitter* e, bool dec, u32 off) {
+    emit8(e, 0x66);
+    emit8(e, 0x41);
+    emit8(e, 0xFF);
+    emit_mem(e, dec, off);
+}
+
+// add word [gb + off], imm8
+static void emit_add16(Emitter* e, u32 off, s8 imm) {
+    emit8(e, 0x66);
+    emit8(e, 0x41);
+    emit8(e, 0x83);
+    emit_mem(e, 0, off);
+    emit8(e, imm);
+}
+
+// mov r8, [rdx]
+static void emit_load_ptr8(Emitter* e, u8 reg) {
+    emit8(e, 0x8A);
+    emit8(e, 0x02 | (reg << 3));
+}
+
+// mov [rdx], r8
+static void emit_store_ptr8(Emitter* e, u8 reg) {
+    emit8(e, 0x88);
+    emit8(e, 0x02 | (reg << 3));
+}
+
+// setcc byte [gb + off]
+static void emit_setcc(Emitter* e, u8 cc, u32 off) {
+    emit8(e, 0x41);
+    emit8(e, 0x0F);
+    emit8(e, 0x90 | cc);
+    emit_mem(e, 0, off);
+}
+
+// add qword [gb->cycles], m_cycles * 4
+static void emit_add_cycles(Emitter* e, u32 m_cycles) {
+    emit8(e, 0x49);
+    emit8(e, 0x81);
+    emit_mem(e, 0, OFF(cycles));
+    emit32(e, m_cycles * 4);
+}
+
+// jcc rel32 to the side exit of the instruction being translated
+static void emit_exit(Emitter* e, u8 cc) {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | cc);
+    JitExit* exit = &e->exits[e->exit_count++];
+    exit->patch = e->p;
+    exit->pc = e->pc;
+    exit->cycles = e->cycles;
+    emit32(e, 0);
+}
+
+// Turns the SM83 address in EAX into a host pointer to size bytes in RDX,
+// through the page table at map or HRAM. Everything else takes the side
+// exit, including a word that straddles two pages. Clobbers ECX.
+static void emit_host_ptr(Emitter* e, u32 map, u8 size) {
+    emit8(e, 0x89); // mov ecx, eax
+    emit8(e, 0xC1);
+    emit8(e, 0xC1); // shr ecx, 8
+    emit8(e, 0xE9);
+    emit8(e, 0x08);
+    emit8(e, 0x49); // mov rdx, [r11 + rcx * 8 + map]
+    emit8(e, 0x8B);
+    emit8(e, 0x94);
+    emit8(e, 0xCB);
+    emit32(e, map);
+    emit8(e, 0x48); // test rdx, rdx
+    emit8(e, 0x85);
+    emit8(e, 0xD2);
+    emit8(e, 0x74); // jz hram
+    u8* hram = e->p;
+    emit8(e, 0);
+
+    if (size == 2) {
+        emit8(e, 0x3C); // cmp al, 0xFF
+        emit8(e, 0xFF);
+        emit_exit(e, CC_Z);
+    }
+    emit8(e, 0x0F); // movzx ecx, al
+    emit8(e, 0xB6);
+    emit8(e, 0xC8);
+    emit8(e, 0x48); // add rdx, rcx
+    emit8(e, 0x01);
+    emit8(e, 0xCA);
+    emit8(e, 0xEB); // jmp done
+    u8* done = e->p;
+    emit8(e, 0);
+
+    *hram = e->p - (hram + 1);
+    emit8(e, 0x8D); // lea ecx, [rax - 0xFF80]
+    emit8(e, 0x88);
+    emit32(e, -0xFF80);
+    emit8(e, 0x83); // cmp ecx, 0x80 - size
+    emit8(e, 0xF9);
+    emit8(e, 0x80 - size);
+    emit_exit(e, CC_NC);
+    emit8(e, 0x49); // mov rdx, [gb->hram]
+    emit8(e, 0x8B);
+    emit_mem(e, DL, OFF(hram));
+    emit8(e, 0x48); // add rdx, rcx
+    emit8(e, 0x01);
+    emit8(e, 0xCA);
+    *done = e->p - (done + 1);
+}
+
+// Points RDX at the byte addressed by the register pair at off
+static void emit_pair_ptr(Emitter* e, u32 off, bool write) {
+    emit_load16(e, AL, off);
+    emit_host_ptr(e, write ? OFF(write_map) : OFF(read_map), 1);
+}
+
+// Points RDX at the top of the stack, or at the word below it for a push
+static void emit_stack_ptr(Emitter* e, bool push) {
+    emit_load16(e, AL, OFF(sp));
+    if (push) {
+        emit8(e, 0x66); // sub ax, 2
+        emit8(e, 0x83);
+        emit8(e, 0xE8);
+        emit8(e, 0x02);
+    }
+    emit_host_ptr(e, push ? OFF(write_map) : OFF(read_map), 2);
+}
+
+// Points RDX at FF00 + index, which has to be in HRAM
+static void emit_hram_ptr(Emitter* e, u8 index) {
+    emit8(e, 0x49); // mov rdx, [gb->hram]
+    emit8(e, 0x8B);
+    emit_mem(e, DL, OFF(hram));
+    emit8(e, 0x48); // add rdx, index - 0x80
+    emit8(e, 0x83);
+    emit8(e, 0xC2);
+    emit8(e, index - 0x80);
+}
+
+// The high byte of f_cres, whose bit 0 is C
+#define OFF_C (OFF(f_cres) + 1)
+
+// bt word [gb->f_cres], 8, which moves C into the host carry for ADC, SBC
+// and the rotates through it
+static void emit_carry_in(Emitter* e) {
+    emit8(e, 0x66);
+    emit8(e, 0x41);
+    emit8(e, 0x0F);
+    emit8(e, 0xBA);
+    emit_mem(e, 4, OFF(f_cres));
+    emit8(e, 8);
+}
+
+// Stores the flags an instruction produced in host EFLAGS, for those flags
+// that are live, in the lazy form flag_z() and friends expect. H comes from
+// x86's AF, which has the same meaning for 8-bit additions, subtractions and
+// INC/DEC and sits in bit 4 of AH after lahf, just like in f_hres.
+static void emit_host_flags(Emitter* e, u8 flags) {
+    if (flags & FLAG_H) {
+        emit8(e, 0x9F); // lahf
+    }
+    if (flags & FLAG_Z) {
+        emit_setcc(e, CC_NZ, OFF(f_zres));
+    }
+    if (flags & FLAG_C) {
+        emit_setcc(e, CC_C, OFF_C);
+    }
+    if (flags & FLAG_H) {
+        // AH can't be addressed alongside r11, go through DL
+        emit8(e, 0x88); // mov dl, ah
+        emit8(e, 0xE2);
+        emit_store8(e, DL, OFF(f_hres));
+    }
+}
+
+// Stores a constant value for each of the live flags in mask
+static void emit_const_flags(Emitter* e, u8 live, u8 mask, u8 values) {
+    if (live & mask & FLAG_Z) {
+        emit_store_imm8(e, OFF(f_zres), !(values & FLAG_Z));
+    }
+    if (live & mask & FLAG_N) {
+        emit_store_imm8(e, OFF(f_n), !!(values & FLAG_N));
+    }
+    if (live & mask & FLAG_H) {
+        emit_store_imm8(e, OFF(f_hres), values & FLAG_H ? 0x10 : 0);
+    }
+    if (live & mask & FLAG_C) {
+        emit_store_imm8(e, OFF_C, values & FLAG_C);
+    }
+}
+
+// Rotates or shifts AL like CB opcodes 00-3F with the given bits 3-5 (which
+// also covers RLCA, RRCA, RLA and RRA), storing C if it's live
+static void emit_shift(Emitter* e, u8 kind, u8 live) {
+    // x86 rol, ror, rcl, rcr, shl, sar, (SWAP), shr as D0 /n extensions
+    static const u8 x86_shift[8] = {0, 1, 2, 3, 4, 7, 0, 5};
+    if (kind == 2 || kind == 3) {
+        emit_carry_in(e);
+    }
+    if (kind == 6) {
+        emit8(e, 0xC0); // rol al, 4
+        emit8(e, 0xC0);
+        emit8(e, 0x04);
+        emit_const_flags(e, live, FLAG_C, 0);
+    } else {
+        emit8(e, 0xD0);
+        emit8(e, 0xC0 | (x86_shift[kind] << 3));
+        if (live & FLAG_C) {
+            emit_setcc(e, CC_C, OFF_C);
+        }
+    }
+}
+
+typedef struct {
+    u16 pc;
+    u8 opcode;
+    u8 imm[2];
+    u8 length;
+    u8 cycles;
+    // Flags this instruction reads and writes
+    u8 reads, writes;
+    // Flags still needed by something after this instruction
+    u8 live;
+    // Whether it can take a side exit, which needs every flag up to date
+    bool exits;
+} JitOp;
+
+typedef enum { OP_UNSUPPORTED, OP_NORMAL, OP_BRANCH } OpKind;
+
+static bool is_hram(u16 addr) { return addr >= 0xFF80 && addr != 0xFFFF; }
+
+// Classifies an opcode and fills in the flags it reads and writes
+static OpKind classify(JitOp* op) {
+    u8 opcode = op->opcode;
+    u16 nn = op->imm[0] | (op->imm[1] << 8);
+    op->reads = op->writes = 0;
+    op->exits = false;
+
+    if (opcode == 0x00) {
+        // NOP
+        return OP_NORMAL;
+    } else if (opcode >= 0x40 && opcode < 0x80) {
+        // LD r, r' (but not HALT)
+        if (opcode == 0x76) {
+            return OP_UNSUPPORTED;
+        }
+        op->exits = (opcode & 0x07) == 6 || ((opcode >> 3) & 0x07) == 6;
+        return OP_NORMAL;
+    } else if (opcode >= 0x80 && opcode < 0xC0) {
+        // ALU A, r
+        u8 alu = (opcode >> 3) & 0x07;
+        if (alu == 1 || alu == 3) {
+            op->reads = FLAG_C;
+        }
+        op->writes = FLAG_ALL;
+        op->exits = (opcode & 0x07) == 6;
+        return OP_NORMAL;
+    }
+
+    switch (opcode) {
+    case 0xCE: // ADC/SBC n
+    case 0xDE:
+        op->reads = FLAG_C;
+        // fall through
+    case 0xC6: // ADD/SUB/AND/XOR/OR/CP n
+    case 0xD6:
+    case 0xE6:
+    case 0xEE:
+    case 0xF6:
+    case 0xFE:
+        op->writes = FLAG_ALL;
+        return OP_NORMAL;
+    case 0x36: // LD [HL], n
+        op->exits = true;
+        return OP_NORMAL;
+    case 0x06: // LD r, n
+    case 0x0E:
+    case 0x16:
+    case 0x1E:
+    case 0x26:
+    case 0x2E:
+    case 0x3E:
+        return OP_NORMAL;
+    case 0x34: // INC/DEC [HL]
+    case 0x35:
+        op->exits = true;
+        // fall through
+    case 0x04: // INC r
+    case 0x0C:
+    case 0x14:
+    case 0x1C:
+    case 0x24:
+    case 0x2C:
+    case 0x3C:
+    case 0x05: // DEC r
+    case 0x0D:
+    case 0x15:
+    case 0x1D:
+    case 0x25:
+    case 0x2D:
+    case 0x3D:
+        op->writes = FLAG_Z | FLAG_N | FLAG_H;
+        return OP_NORMAL;
+    case 0x03: // INC rr
+    case 0x13:
+    case 0x23:
+    case 0x33:
+    case 0x0B: // DEC rr
+    case 0x1B:
+    case 0x2B:
+    case 0x3B:
+    case 0x01: // LD rr, nn
+    case 0x11:
+    case 0x21:
+    case 0x31:
+    case 0xF9: // LD SP, HL
+        return OP_NORMAL;
+    case 0x09: // ADD HL, rr
+    case 0x19:
+    case 0x29:
+    case 0x39:
+        op->writes = FLAG_N | FLAG_H | FLAG_C;
+        return OP_NORMAL;
+    case 0x02: // LD [BC], A / LD [DE], A / LD [HL+], A / LD [HL-], A
+    case 0x12:
+    case 0x22:
+    case 0x32:
+    case 0x0A: // LD A, [BC] / LD A, [DE] / LD A, [HL+] / LD A, [HL-]
+    case 0x1A:
+    case 0x2A:
+    case 0x3A:
+    case 0xC5: // PUSH rr (except AF)
+    case 0xD5:
+    case 0xE5:
+    case 0xC1: // POP rr (except AF)
+    case 0xD1:
+    case 0xE1:
+        op->exits = true;
+        return OP_NORMAL;
+    case 0xE0: // LDH [n], A / LDH A, [n], for HRAM only
+    case 0xF0:
+        return is_hram(0xFF00 | op->imm[0]) ? OP_NORMAL : OP_UNSUPPORTED;
+    case 0xEA: // LD [nn], A, not for IO or MBC registers
+        if (nn < 0x8000) {
+            return OP_UNSUPPORTED;
+        }
+        // fall through
+    case 0xFA: // LD A, [nn], not for IO
+        if (nn >= 0xFE00 && !is_hram(nn)) {
+            return OP_UNSUPPORTED;
+        }
+        op->exits = !is_hram(nn);
+        return OP_NORMAL;
+    case 0x08: // LD [nn], SP
+        if (nn < 0x8000 || nn >= 0xFE00) {
+            return OP_UNSUPPORTED;
+        }
+        op->exits = true;
+        return OP_NORMAL;
+    case 0x2F: // CPL
+        op->writes = FLAG_N | FLAG_H;
+        return OP_NORMAL;
+    case 0x37: // SCF
+        op->writes = FLAG_N | FLAG_H | FLAG_C;
+        return OP_NORMAL;
+    case 0x3F: // CCF
+        op->reads = FLAG_C;
+        op->writes = FLAG_N | FLAG_H | FLAG_C;
+        return OP_NORMAL;
+    case 0x17: // RLA / RRA
+    case 0x1F:
+        op->reads = FLAG_C;
+        // fall through
+    case 0x07: // RLCA / RRCA
+    case 0x0F:
+        op->writes = FLAG_ALL;
+        return OP_NORMAL;
+    case 0xCB: {
+        u8 cb = op->imm[0];
+        if (cb < 0x40) {
+            // Rotates and shifts, RL and RR through the carry
+            u8 kind = cb >> 3;
+            op->reads = kind == 2 || kind == 3 ? FLAG_C : 0;
+            op->writes = FLAG_ALL;
+        } else if (cb < 0x80) {
+            // BIT
+            op->writes = FLAG_Z | FLAG_N | FLAG_H;
+        }
+        op->exits = (cb & 0x07) == 6;
+        return OP_NORMAL;
+    }
+    case 0x18: // JR e
+    case 0xC3: // JP nn
+    case 0xE9: // JP HL
+        return OP_BRANCH;
+    case 0xCD: // CALL nn
+    case 0xC9: // RET
+    case 0xC7: // RST n
+    case 0xCF:
+    case 0xD7:
+    case 0xDF:
+    case 0xE7:
+    case 0xEF:
+    case 0xF7:
+    case 0xFF:
+        op->exits = true;
+        return OP_BRANCH;
+    case 0xC4: // CALL cc, nn
+    case 0xCC:
+    case 0xD4:
+    case 0xDC:
+    case 0xC0: // RET cc
+    case 0xC8:
+    case 0xD0:
+    case 0xD8:
+        op->exits = true;
+        // fall through
+    case 0x20: // JR cc, e
+    case 0x28:
+    case 0x30:
+    case 0x38:
+    case 0xC2: // JP cc, nn
+    case 0xCA:
+    case 0xD2:
+    case 0xDA:
+        op->reads = opcode & 0x10 ? FLAG_C : FLAG_Z;
+        return OP_BRANCH;
+    default:
+        return OP_UNSUPPORTED;
+    }
+}
+
+// Translates CB opcodes, on a register or [HL]
+static void emit_cb(Emitter* e, u8 cb, u8 live) {
+    u8 group = cb >> 6;
+    u8 bit = (cb >> 3) & 0x07;
+    bool hl = (cb & 0x07) == 6;
+
+    if (hl) {
+        // BIT only reads, the rest need a page that can be written
+        emit_pair_ptr(e, OFF(hl), group != 1);
+        emit_load_ptr8(e, AL);
+    } else {
+        emit_load8(e, AL, reg_offsets[cb & 0x07]);
+    }
+
+    switch (group) {
+    case 0:
+        // Rotates don't touch host ZF, so test the result
+        emit_shift(e, bit, live);
+        if (live & FLAG_Z) {
+            emit8(e, 0x84); // test al, al
+            emit8(e, 0xC0);
+            emit_setcc(e, CC_NZ, OFF(f_zres));
+        }
+        emit_const_flags(e, live, FLAG_N | FLAG_H, 0);
+        break;
+    case 1:
+        // BIT: test al, mask
+        emit8(e, 0xA8);
+        emit8(e, 1 << bit);
+        if (live & FLAG_Z) {
+            emit_setcc(e, CC_NZ, OFF(f_zres));
+        }
+        emit_const_flags(e, live, FLAG_N | FLAG_H, FLAG_H);
+        return;
+    case 2:
+        // RES: and al, ~mask
+        emit8(e, 0x24);
+        emit8(e, ~(1 << bit));
+        break;
+    case 3:
+        // SET: or al, mask
+        emit8(e, 0x0C);
+        emit8(e, 1 << bit);
+        break;
+    }
+
+    if (hl) {
+        emit_store_ptr8(e, AL);
+    } else {
+        emit_store8(e, AL, reg_offsets[cb & 0x07]);
+    }
+}
+
+// Translates a single non-branch instruction
+static void emit_op(Emitter* e, JitOp* op) {
+    u8 opcode = op->opcode;
+    u8 live = op->live & op->writes;
+    u16 nn = op->imm[0] | (op->imm[1] << 8);
+
+    if (opcode == 0x00) {
+        return;
+    } else if (opcode >= 0x40 && opcode < 0x80) {
+        // LD r, r'
+        u8 src = opcode & 0x07;
+        u8 dst = (opcode >> 3) & 0x07;
+        if (src == 6) {
+            emit_pair_ptr(e, OFF(hl), false);
+            emit_load_ptr8(e, AL);
+        } else {
+            if (dst == 6) {
+                emit_pair_ptr(e, OFF(hl), true);
+            }
+            emit_load8(e, AL, reg_offsets[src]);
+        }
+        if (dst == 6) {
+            emit_store_ptr8(e, AL);
+        } else {
+            emit_store8(e, AL, reg_offsets[dst]);
+        }
+        return;
+    } else if (opcode >= 0x80 && (opcode < 0xC0 || (opcode & 0x07) == 6)) {
+        // ALU A, r / ALU A, n
+        u8 alu = (opcode >> 3) & 0x07;
+        // x86 opcodes for op r/m8, r8 (imm8 forms are these + 4)
+        static const u8 x86_alu[8] = {0x00, 0x10, 0x28, 0x18,
+                                      0x20, 0x30, 0x08, 0x38};
+        if (opcode < 0xC0) {
+            if ((opcode & 0x07) == 6) {
+                emit_pair_ptr(e, OFF(hl), false);
+                emit_load_ptr8(e, CL);
+            } else {
+                emit_load8(e, CL, reg_offsets[opcode & 0x07]);
+            }
+        }
+        emit_load8(e, AL, OFF(a));
+        if (alu == 1 || alu == 3) {
+            emit_carry_in(e);
+        }
+        if (opcode >= 0xC0) {
+            emit8(e, x86_alu[alu] + 4);
+            emit8(e, op->imm[0]);
+        } else {
+            emit8(e, x86_alu[alu]);
+            emit8(e, 0xC8); // al, cl
+        }
+
+        if (alu <= 3 || alu == 7) {
+            // ADD, ADC, SUB, SBC, CP
+            emit_host_flags(e, live & (FLAG_Z | FLAG_H | FLAG_C));
+            emit_const_flags(e, live, FLAG_N, alu <= 1 ? 0 : FLAG_N);
+        } else {
+            // AND sets H, OR and XOR clear it
+            emit_host_flags(e, live & FLAG_Z);
+            emit_const_flags(e, live, FLAG_N | FLAG_H | FLAG_C,
+                             alu == 4 ? FLAG_H : 0);
+        }
+        if (alu != 7) {
+            emit_store8(e, AL, OFF(a));
+        }
+        return;
+    }
+
+    switch (opcode) {
+    case 0x06:
+    case 0x0E:
+    case 0x16:
+    case 0x1E:
+    case 0x26:
+    case 0x2E:
+    case 0x3E:
+        // LD r, n
+        emit_store_imm8(e, reg_offsets[opcode >> 3], op->imm[0]);
+        break;
+    case 0x36:
+        // LD [HL], n: mov byte [rdx], n
+        emit_pair_ptr(e, OFF(hl), true);
+        emit8(e, 0xC6);
+        emit8(e, 0x02);
+        emit8(e, op->imm[0]);
+        break;
+    case 0x04:
+    case 0x0C:
+    case 0x14:
+    case 0x1C:
+    case 0x24:
+    case 0x2C:
+    case 0x34:
+    case 0x3C:
+    case 0x05:
+    case 0x0D:
+    case 0x15:
+    case 0x1D:
+    case 0x25:
+    case 0x2D:
+    case 0x35:
+    case 0x3D: {
+        // inc/dec byte [r], which leave the carry alone just like the SM83
+        bool dec = opcode & 1;
+        if (opcode == 0x34 || opcode == 0x35) {
+            emit_pair_ptr(e, OFF(hl), true);
+            emit8(e, 0xFE);
+            emit8(e, 0x02 | (dec << 3));
+        } else {
+            emit8(e, 0x41);
+            emit8(e, 0xFE);
+            emit_mem(e, dec, reg_offsets[opcode >> 3]);
+        }
+        emit_host_flags(e, live & (FLAG_Z | FLAG_H));
+        emit_const_flags(e, live, FLAG_N, dec ? FLAG_N : 0);
+        break;
+    }
+    case 0x03:
+    case 0x13:
+    case 0x23:
+    case 0x33:
+    case 0x0B:
+    case 0x1B:
+    case 0x2B:
+    case 0x3B:
+        // INC/DEC rr
+        emit_incdec16(e, (opcode >> 3) & 1, pair_offsets[opcode >> 4]);
+        break;
+    case 0x01:
+    case 0x11:
+    case 0x21:
+    case 0x31:
+        // LD rr, nn
+        emit_store_imm16(e, pair_offsets[opcode >> 4], nn);
+        break;
+    case 0xF9:
+        // LD SP, HL
+        emit_load16(e, AL, OFF(hl));
+        emit_store16(e, AL, OFF(sp));
+        break;
+    case 0x09:
+    case 0x19:
+    case 0x29:
+    case 0x39:
+        // ADD HL, rr, with H from bit 12 of HL ^ rr ^ result, and C from
+        // bit 16 of the result
+        emit_load16(e, AL, OFF(hl));
+        emit_load16(e, CL, pair_offsets[opcode >> 4]);
+        emit8(e, 0x8D); // lea edx, [rax + rcx]
+        emit8(e, 0x14);
+        emit8(e, 0x08);
+        if (live & FLAG_H) {
+            emit8(e, 0x31); // xor eax, ecx
+            emit8(e, 0xC8);
+            emit8(e, 0x31); // xor eax, edx
+            emit8(e, 0xD0);
+            emit8(e, 0xC1); // shr eax, 8
+            emit8(e, 0xE8);
+            emit8(e, 0x08);
+            emit_store8(e, AL, OFF(f_hres));
+        }
+        emit_store16(e, DL, OFF(hl));
+        if (live & FLAG_C) {
+            emit8(e, 0xC1); // shr edx, 8
+            emit8(e, 0xEA);
+            emit8(e, 0x08);
+            emit_store16(e, DL, OFF(f_cres));
+        }
+        emit_const_flags(e, live, FLAG_N, 0);
+        break;
+    case 0x02:
+    case 0x12:
+    case 0x22:
+    case 0x32:
+    case 0x0A:
+    case 0x1A:
+    case 0x2A:
+    case 0x3A: {
+        // LD [rr], A / LD A, [rr], with HL+ and HL- in place of HL and SP
+        bool load = opcode & 0x08;
+        u32 pair = pair_offsets[opcode >= 0x20 ? 2 : opcode >> 4];
+        emit_pair_ptr(e, pair, !load);
+        if (load) {
+            emit_load_ptr8(e, AL);
+            emit_store8(e, AL, OFF(a));
+        } else {
+            emit_load8(e, AL, OFF(a));
+            emit_store_ptr8(e, AL);
+        }
+        if (opcode >= 0x20) {
+            emit_incdec16(e, opcode >= 0x30, OFF(hl));
+        }
+        break;
+    }
+    case 0xE0:
+    case 0xF0:
+    case 0xEA:
+    case 0xFA: {
+        // LDH [n], A / LDH A, [n] / LD [nn], A / LD A, [nn]
+        u16 addr = opcode & 0x0A ? nn : 0xFF00 | op->imm[0];
+        if (is_hram(addr)) {
+            emit_hram_ptr(e, addr & 0xFF);
+        } else {
+            emit8(e, 0xB8); // mov eax, addr
+            emit32(e, addr);
+            emit_host_ptr(e, opcode & 0x10 ? OFF(read_map) : OFF(write_map),
+                          1);
+        }
+        if (opcode & 0x10) {
+            emit_load_ptr8(e, AL);
+            emit_store8(e, AL, OFF(a));
+        } else {
+            emit_load8(e, AL, OFF(a));
+            emit_store_ptr8(e, AL);
+        }
+        break;
+    }
+    case 0x08:
+        // LD [nn], SP
+        emit8(e, 0xB8); // mov eax, nn
+        emit32(e, nn);
+        emit_host_ptr(e, OFF(write_map), 2);
+        emit_load16(e, CL, OFF(sp));
+        emit8(e, 0x66); // mov [rdx], cx
+        emit8(e, 0x89);
+        emit8(e, 0x0A);
+        break;
+    case 0xC5:
+    case 0xD5:
+    case 0xE5:
+        // PUSH rr: mov [rdx], cx
+        emit_stack_ptr(e, true);
+        emit_load16(e, CL, pair_offsets[(opcode >> 4) & 0x03]);
+        emit8(e, 0x66);
+        emit8(e, 0x89);
+        emit8(e, 0x0A);
+        emit_add16(e, OFF(sp), -2);
+        break;
+    case 0xC1:
+    case 0xD1:
+    case 0xE1:
+        // POP rr: movzx ecx, word [rdx]
+        emit_stack_ptr(e, false);
+        emit8(e, 0x0F);
+        emit8(e, 0xB7);
+        emit8(e, 0x0A);
+        emit_store16(e, CL, pair_offsets[(opcode >> 4) & 0x03]);
+        emit_add16(e, OFF(sp), 2);
+        break;
+    case 0x07:
+    case 0x0F:
+    case 0x17:
+    case 0x1F:
+        // RLCA / RRCA / RLA / RRA, which always clear Z
+        emit_load8(e, AL, OFF(a));
+        emit_shift(e, opcode >> 3, live);
+        emit_store8(e, AL, OFF(a));
+        emit_const_flags(e, live, FLAG_Z | FLAG_N | FLAG_H, 0);
+        break;
+    case 0xCB:
+        emit_cb(e, op->imm[0], live);
+        break;
+    case 0x2F:
+        // CPL: not byte [a]
+        emit8(e, 0x41);
+        emit8(e, 0xF6);
+        emit_mem(e, 2, OFF(a));
+        emit_const_flags(e, live, FLAG_N | FLAG_H, FLAG_N | FLAG_H);
+        break;
+    case 0x37:
+        // SCF
+        emit_const_flags(e, live, FLAG_N | FLAG_H | FLAG_C, FLAG_C);
+        break;
+    case 0x3F:
+        // CCF: xor byte [f_cres + 1], 1
+        if (live & FLAG_C) {
+            emit8(e, 0x41);
+            emit8(e, 0x80);
+            emit_mem(e, 6, OFF_C);
+            emit8(e, 1);
+        }
+        emit_const_flags(e, live, FLAG_N | FLAG_H, 0);
+        break;
+    }
+}
+
+// Translates the final jump, call or return of a block that started
+// cycles M-cycles earlier, and that falls through to pc
+static u8 emit_branch(Emitter* e, JitOp* op, u16 pc, u32 cycles) {
+    u8 opcode = op->opcode;
+    u16 nn = op->imm[0] | (op->imm[1] << 8);
+    // JR cc, JP cc, CALL cc and RET cc take longer when the condition holds
+    u8 extra = 0;
+    u8* skip = NULL;
+
+    if ((opcode & 0xE7) == 0x20 || (opcode & 0xE1) == 0xC0) {
+        extra = opcode < 0x40 || (opcode & 0x07) == 2 ? 1 : 3;
+        // Test the flag, then skip the taken path if the condition doesn't
+        // hold. x86 ZF ends up set when Z is set or C is clear.
+        u8 cond = (opcode >> 3) & 3;
+        bool skip_if_zf;
+        emit8(e, 0x41);
+        if (cond & 2) {
+            // test byte [f_cres + 1], 1
+            emit8(e, 0xF6);
+            emit_mem(e, 0, OFF_C);
+            emit8(e, 0x01);
+            skip_if_zf = cond & 1;
+        } else {
+            // cmp byte [f_zres], 0
+            emit8(e, 0x80);
+            emit_mem(e, 7, OFF(f_zres));
+            emit8(e, 0x00);
+            skip_if_zf = !(cond & 1);
+        }
+        emit8(e, 0x0F); // je/jne rel32
+        emit8(e, 0x80 | (skip_if_zf ? CC_Z : CC_NZ));
+        skip = e->p;
+        emit32(e, 0);
+    }
+
+    switch (opcode) {
+    case 0x18:
+    case 0x20:
+    case 0x28:
+    case 0x30:
+    case 0x38:
+        // JR
+        emit_store_imm16(e, OFF(pc), pc + (s8)op->imm[0]);
+        break;
+    case 0xE9:
+        // JP HL
+        emit_load16(e, AL, OFF(hl));
+        emit_store16(e, AL, OFF(pc));
+        break;
+    case 0xC0:
+    case 0xC8:
+    case 0xD0:
+    case 0xD8:
+    case 0xC9:
+        // RET: movzx ecx, word [rdx]
+        emit_stack_ptr(e, false);
+        emit8(e, 0x0F);
+        emit8(e, 0xB7);
+        emit8(e, 0x0A);
+        emit_store16(e, CL, OFF(pc));
+        emit_add16(e, OFF(sp), 2);
+        break;
+    default:
+        if ((opcode & 0x07) == 2 || opcode == 0xC3) {
+            // JP
+            emit_store_imm16(e, OFF(pc), nn);
+            break;
+        }
+        // CALL and RST push pc: mov word [rdx], pc
+        emit_stack_ptr(e, true);
+        emit8(e, 0x66);
+        emit8(e, 0xC7);
+        emit8(e, 0x02);
+        emit16(e, pc);
+        emit_add16(e, OFF(sp), -2);
+        emit_store_imm16(e, OFF(pc), (opcode & 0x07) == 7 ? opcode & 0x38 : nn);
+        break;
+    }
+    emit_add_cycles(e, cycles + op->cycles + extra);
+
+    if (skip) {
+        emit8(e, 0xC3); // ret
+        patch32(skip, e->p);
+        emit_store_imm16(e, OFF(pc), pc);
+        emit_add_cycles(e, cycles + op->cycles);
+    }
+    return extra;
+}
+
+// Translates the block at pc into the code buffer, returning false if its
+// first instruction can't be translated
+static bool compile_block(JitCache* jit, JitBlock* block) {
+    JitOp ops[JIT_MAX_OPS];
+    int count = 0;
+    u8* page = block->page;
+    u16 offset = block->pc & 0xFF;
+    u16 pc = block->pc;
+    bool branch = false;
+
+    // Scan forward to the first untranslatable instruction or a branch
+    while (count < JIT_MAX_OPS) {
+        JitOp* op = &ops[count];
+        op->pc = pc;
+        op->opcode = page[offset];
+        op->length = op_lengths[op->opcode];
+        if (offset + op->length > 0x100) {
+            break;
+        }
+        memcpy(op->imm, page + offset + 1, op->length - 1);
+        OpKind kind = classify(op);
+        if (kind == OP_UNSUPPORTED) {
+            break;
+        }
+        op->cycles = op->opcode == 0xCB ? cb_cycles(op->imm[0])
+                                        : op_cycles[op->opcode];
+        offset += op->length;
+        pc += op->length;
+        count++;
+        if (kind == OP_BRANCH) {
+            branch = true;
+            break;
+        }
+        if (offset == 0x100) {
+            break;
+        }
+    }
+    if (!count) {
+        return false;
+    }
+
+    // Flag liveness, backwards from the exit where everything is live. The
+    // interpreter may pick up at any side exit, so they need all of them.
+    u8 live = FLAG_ALL;
+    for (int i = count - 1; i >= 0; i--) {
+        ops[i].live = live;
+        live = (live & ~ops[i].writes) | ops[i].reads;
+        if (ops[i].exits) {
+            live = FLAG_ALL;
+        }
+    }
+
+    if (jit->code_used + (count + 2) * JIT_MAX_OP_BYTES > JIT_CODE_SIZE) {
+        // Out of space, start over
+        JitBlock keep = *block;
+        memset(jit->blocks, 0, sizeof(jit->blocks));
+        jit->code_used = 0;
+        *block = keep;
+    }
+
+    Emitter e;
+    e.p = jit->code + jit->code_used;
+    e.exit_count = 0;
+    u8* start = e.p;
+#ifdef _WIN32
+    emit8(&e, 0x49); // mov r11, rcx
+    emit8(&e, 0x89);
+    emit8(&e, 0xCB);
+#else
+    emit8(&e, 0x49); // mov r11, rdi
+    emit8(&e, 0x89);
+    emit8(&e, 0xFB);
+#endif
+
+    u32 cycles = 0;
+    for (int i = 0; i < count - branch; i++) {
+        e.pc = ops[i].pc;
+        e.cycles = cycles;
+        emit_op(&e, &ops[i]);
+        cycles += ops[i].cycles;
+    }
+
+    u8 extra = 0;
+    if (branch) {
+        JitOp* op = &ops[count - 1];
+        if (op->opcode < 0x40 && (s8)op->imm[0] < 0) {
+            block->loop_length = -(s8)op->imm[0];
+            block->loop_pc = pc + (s8)op->imm[0];
+        }
+        e.pc = op->pc;
+        e.cycles = cycles;
+        extra = emit_branch(&e, op, pc, cycles);
+        cycles += op->cycles;
+    } else {
+        emit_add_cycles(&e, cycles);
+        emit_store_imm16(&e, OFF(pc), pc);
+    }
+    emit8(&e, 0xC3); // ret
+
+    // Side exits account for the instructions that ran and leave pc at the
+    // one that couldn't, for the interpreter to run
+    u8* stub = NULL;
+    for (int i = 0; i < e.exit_count; i++) {
+        JitExit* exit = &e.exits[i];
+        if (!i || exit->pc != exit[-1].pc) {
+            stub = e.p;
+            if (exit->cycles) {
+                emit_add_cycles(&e, exit->cycles);
+            }
+            emit_store_imm16(&e, OFF(pc), exit->pc);
+            emit8(&e, 0xC3); // ret
+        }
+        patch32(exit->patch, stub);
+    }
+
+    block->code = (JitFunc)start;
+    block->count = count;
+    block->max_cycles = cycles + extra;
+    block->min_cycles = cycles;
+    jit->code_used += e.p - start;
+    return true;
+}
+
+bool enable_jit(GameBoy* gb) {
+    if (gb->jit) {
+        return true;
+    }
+    JitCache* jit = calloc(1, sizeof(JitCache));
+    if (!jit) {
+        return false;
+    }
+#ifdef _WIN32
+    jit->code = VirtualAlloc(NULL, JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE,
+                             PAGE_EXECUTE_READWRITE);
+#else
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        jit->code = NULL;
+    }
+#endif
+    if (!jit->code) {
+        free(jit);
+        return false;
+    }
+    gb->jit = jit;
+    enable_block_cache(gb);
+    return true;
+}
+
+void free_jit(GameBoy* gb) {
+    if (gb->jit) {
+#ifdef _WIN32
+        VirtualFree(gb->jit->code, 0, MEM_RELEASE);
+#else
+        munmap(gb->jit->code, JIT_CODE_SIZE);
+#endif
+        free(gb->jit);
+        gb->jit = NULL;
+    }
+}
+
+// Runs a block's code, then gives the loop it closes (if any) the same idle
+// check as the interpreter's JR, unless it left through a side exit
+static void run_code(GameBoy* gb, JitBlock* block) {
+    u64 start = gb->cycles;
+    block->code(gb);
+    if (block->loop_length && gb->pc == block->loop_pc &&
+        gb->cycles - start == 4 * block->max_cycles) {
+        skip_idle_loop(gb, block->loop_length);
+    }
+}
+
+#ifdef RONDO_JIT_VERIFY
+// Registers a block can change, for cross-checking against the interpreter
+typedef struct {
+    u8 a, b, c, d, e, h, l;
+    bool f_z, f_n, f_h, f_c;
+    u16 pc, sp;
+    u64 cycles;
+} JitRegs;
+
+static JitRegs get_regs(GameBoy* gb) {
+    JitRegs r;
+    // Padding is zeroed too, so that snapshots can be compared with memcmp
+    memset(&r, 0, sizeof(r));
+    r.a = gb->a;
+    r.b = gb->b;
+    r.c = gb->c;
+    r.d = gb->d;
+    r.e = gb->e;
+    r.h = gb->h;
+    r.l = gb->l;
+    r.f_z = flag_z(gb);
+    r.f_n = gb->f_n;
+    r.f_h = flag_h(gb);
+    r.f_c = flag_c(gb);
+    r.pc = gb->pc;
+    r.sp = gb->sp;
+    r.cycles = gb->cycles;
+    return r;
+}
+
+static void set_regs(GameBoy* gb, JitRegs* r) {
+    gb->a = r->a;
+    gb->b = r->b;
+    gb->c = r->c;
+    gb->d = r->d;
+    gb->e = r->e;
+    gb->h = r->h;
+    gb->l = r->l;
+    set_flags(gb, r->f_z, r->f_n, r->f_h, r->f_c);
+    gb->pc = r->pc;
+    gb->sp = r->sp;
+    gb->cycles = r->cycles;
+}
+
+// Memory a block can change: the pages mapped for writing, and HRAM
+typedef struct {
+    u8 pages[256][0x100];
+    u8 hram[0x7F];
+} JitMemory;
+
+static void get_memory(GameBoy* gb, JitMemory* m) {
+    for (int i = 0; i < 256; i++) {
+        if (gb->write_map[i]) {
+            memcpy(m->pages[i], gb->write_map[i], 0x100);
+        } else {
+            memset(m->pages[i], 0, 0x100);
+        }
+    }
+    memcpy(m->hram, gb->hram, 0x7F);
+}
+
+static void set_memory(GameBoy* gb, JitMemory* m) {
+    for (int i = 0; i < 256; i++) {
+        if (gb->write_map[i]) {
+            memcpy(gb->write_map[i], m->pages[i], 0x100);
+        }
+    }
+    memcpy(gb->hram, m->hram, 0x7F);
+}
+
+// Runs the block both ways and aborts if the results differ
+static void run_verified(GameBoy* gb, JitBlock* block) {
+    static JitMemory before_mem, jit_mem, interp_mem;
+    JitRegs before = get_regs(gb);
+    get_memory(gb, &before_mem);
+    run_code(gb, block);
+    JitRegs jit = get_regs(gb);
+    get_memory(gb, &jit_mem);
+
+    // The block may have stopped early at a side exit, so run the
+    // interpreter for as long as it did rather than for block->count
+    set_regs(gb, &before);
+    set_memory(gb, &before_mem);
+    while (gb->cycles < jit.cycles) {
+        run_opcode(gb);
+    }
+    JitRegs interp = get_regs(gb);
+    get_memory(gb, &interp_mem);
+
+    if (memcmp(&jit, &interp, sizeof(JitRegs))) {
+        printf("JIT mismatch in block at %04X:\n", block->pc);
+        printf("        a  b  c  d  e  h  l  znhc pc   sp   cycles\n");
+        JitRegs* rs[2] = {&jit, &interp};
+        for (int i = 0; i < 2; i++) {
+            JitRegs* r = rs[i];
+            printf("%-7s %02X %02X %02X %02X %02X %02X %02X %d%d%d%d %04X "
+                   "%04X %llu\n",
+                   i ? "interp" : "jit", r->a, r->b, r->c, r->d, r->e, r->h,
+                   r->l, r->f_z, r->f_n, r->f_h, r->f_c, r->pc, r->sp,
+                   (unsigned long long)r->cycles);
+        }
+        exit(1);
+    }
+    u8* jit_bytes = (u8*)&jit_mem;
+    u8* interp_bytes = (u8*)&interp_mem;
+    for (size_t i = 0; i < sizeof(JitMemory); i++) {
+        if (jit_bytes[i] != interp_bytes[i]) {
+            u16 addr = i < 0x10000 ? i : 0xFF80 + (i - 0x10000);
+            printf("JIT mismatch in block at %04X: %04X is %02X, not %02X\n",
+                   block->pc, addr, jit_bytes[i], interp_bytes[i]);
+            exit(1);
+        }
+    }
+}
+#endif
+
+// Runs the translated block at pc, or returns false if there isn't one or
+// it couldn't even run its first instruction
+static bool jit_run_block(GameBoy* gb) {
+    u16 pc = gb->pc;
+    if (pc >= 0x8000) {
+        return false;
+    }
+
+    JitCache* jit = gb->jit;
+    JitBlock* block = &jit->blocks[pc % JIT_CACHE_SIZE];
+    u8* page = gb->read_map[pc >> 8];
+    if (block->pc != pc || block->page != page) {
+        memset(block, 0, sizeof(JitBlock));
+        block->pc = pc;
+        block->page = page;
+    }
+
+    if (block->state == JIT_COLD) {
+        if (++block->hits < JIT_HOT_THRESHOLD) {
+            return false;
+        }
+        block->state =
+            compile_block(jit, block) ? JIT_COMPILED : JIT_UNSUPPORTED;
+    }
+    if (block->state != JIT_COMPILED) {
+        return false;
+    }
+
+    // Cycles are only added at the end of the block, so it mustn't run
+    // into an event
+    u64 cycles = gb->cycles;
+    if (cycles + 4 * block->max_cycles >= gb->next_event) {
+        return false;
+    }
+
+#ifdef RONDO_JIT_VERIFY
+    run_verified(gb, block);
+#else
+    run_code(gb, block);
+#endif
+
+    // A block that mostly leaves early through a side exit costs more than
+    // the cached block would, so leave it to that
+    if (gb->cycles - cycles < 4 * block->min_cycles) {
+        if (++block->bails >= JIT_HOT_THRESHOLD) {
+            block->state = JIT_UNSUPPORTED;
+        }
+    } else if (block->bails) {
+        block->bails--;
+    }
+    return gb->cycles != cycles;
+}
+
+void run_jit(GameBoy* gb) {
+    while (!gb->end_frame) {
+        if (needs_run_opcode(gb) ||
+            (!jit_run_block(gb) && !run_block(gb))) {
+            run_opcode(gb);
+        }
+    }
+}
+
+#else
+
+bool enable_jit(GameBoy* gb) {
+    (void)gb;
+    return false;
+}
+
+void free_jit(GameBoy* gb) { (void)gb; }
+
+void run_jit(GameBoy* gb) {
+    while (!gb->end_frame) {
+        run_opcode(gb);
+    }
+}
+
+#endif
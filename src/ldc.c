@@ -1,51 +1,116 @@
 #include "lcd.h"
+#include "simd.h"
 #include "stdio.h"
+#include "string.h"
 
+// Returns row y (0-7) of a tile from the decoded tile cache, decoding the
+// tile first if VRAM has changed since it was last used
 // tile_ids from 0x100 to 0x17F are used for BG/Window tiles in $9000–$97FF
-static u8 get_tile_pixel(GameBoy* gb, u16 tile_id, u8 x, u8 y) {
-    u8 lsb = gb->vram[16 * tile_id + 2 * y];
-    u8 msb = gb->vram[16 * tile_id + 2 * y + 1];
-    lsb = (lsb >> (7 - x)) & 1;
-    msb = (msb >> (7 - x)) & 1;
-    return (msb << 1) + lsb;
+static u8* get_tile_row(GameBoy* gb, u16 tile_id, u8 y) {
+    u8* tile = gb->tile_cache + 64 * tile_id;
+    if (gb->tile_dirty[tile_id]) {
+        decode_tile_rows(gb->vram + 16 * tile_id, tile, 8);
+        gb->tile_dirty[tile_id] = false;
+    }
+    return tile + 8 * y;
 }
 
-// x and y are tile-based coords, not pixel-based
-static u8 get_bg_tile(GameBoy* gb, u8 x, u8 y, bool is_win) {
-    bool is_alt_map = is_win ? gb->win_map : gb->bg_map;
-    u8* tile_map = is_alt_map ? (gb->vram + 0x1C00) : (gb->vram + 0x1800);
-    return tile_map[y * 32 + x];
-}
+static void render_bg(GameBoy* gb, u8* line) {
+    u8 y = gb->ly + gb->scy;
+    u8* tile_map = gb->vram + (gb->bg_map ? 0x1C00 : 0x1800) + (y / 8) * 32;
 
-static void render_pixel(GameBoy* gb, u8 x, u8 y) {
-    // Background/Window
-    u16 tile_id = get_bg_tile(gb, x / 8, y / 8, false);
-    if (!gb->tile_sel && (tile_id < 0x80)) {
-        tile_id += 0x100;
+    // One extra tile is fetched so that a fine scroll can shift it in
+    u8 buff[SCREEN_WIDTH + 8];
+    u8 tile_x = gb->scx / 8;
+    for (int i = 0; i <= SCREEN_WIDTH / 8; i++) {
+        u16 tile_id = tile_map[(tile_x + i) % 32];
+        if (!gb->tile_sel && (tile_id < 0x80)) {
+            tile_id += 0x100;
+        }
+        memcpy(buff + 8 * i, get_tile_row(gb, tile_id, y % 8), 8);
     }
-    u8 color = get_tile_pixel(gb, tile_id, x % 8, y % 8);
+    memcpy(line, buff + gb->scx % 8, SCREEN_WIDTH);
+}
 
-    // Set pixel in fbuf
-    u8* buff = gb->fbuf;
-    buff[x + SCREEN_WIDTH * y] = color;
+// Draws the whole of the current line at the end of Mode 3
+static void render_scanline(GameBoy* gb) {
+    if (!gb->fbuf) {
+        // Frame isn't going to be shown
+        return;
+    }
+    u8 line[SCREEN_WIDTH];
+    render_bg(gb, line);
+    expand_palette(line, (u32*)gb->fbuf + SCREEN_WIDTH * gb->ly, SCREEN_WIDTH,
+                   gb->bgp, gb->palette);
 }
 
-void lcd_cycle(GameBoy* gb) {
-    gb->dots++;
-    if (gb->dots >= 376) {
-        gb->dots = -80;
-        gb->ly++;
-        if (gb->ly >= 154) {
-            gb->ly = 0;
+// Dot at which the PPU next changes mode on the current line
+static s16 next_boundary(GameBoy* gb) {
+    if (gb->ly < SCREEN_HEIGHT) {
+        if (gb->dots < 0) {
+            return 0;
+        } else if (gb->dots < SCREEN_WIDTH) {
+            return SCREEN_WIDTH;
         }
-        if (gb->ly == SCREEN_HEIGHT) {
-            // Set V-Blank flag in IF
-            gb->if_ |= (1 << 0);
+    }
+    return 376;
+}
+
+void lcd_sync(GameBoy* gb) {
+    if (!gb->lcd_en) {
+        // PPU is frozen while the LCD is off, but frames still end every
+        // CYCLES_PER_FRAME from when it went off so that run_frame returns
+        while (gb->cycles - gb->lcd_time >= CYCLES_PER_FRAME) {
+            gb->lcd_time += CYCLES_PER_FRAME;
             gb->end_frame = true;
         }
+        schedule(gb, EVENT_LCD, gb->lcd_time + CYCLES_PER_FRAME);
+        return;
+    }
+
+    while (gb->lcd_time < gb->cycles) {
+        // Jump straight to the next mode change, or to the present
+        u64 step = next_boundary(gb) - gb->dots;
+        if (step > gb->cycles - gb->lcd_time) {
+            step = gb->cycles - gb->lcd_time;
+        }
+        gb->dots += step;
+        gb->lcd_time += step;
+
+        if (gb->dots >= 376) {
+            gb->dots = -80;
+            gb->ly++;
+            if (gb->ly >= 154) {
+                gb->ly = 0;
+            }
+            if (gb->ly == SCREEN_HEIGHT) {
+                // Set V-Blank flag in IF
+                gb->if_ |= (1 << 0);
+                gb->end_frame = true;
+            }
+        }
+
+        if (gb->ly < SCREEN_HEIGHT && gb->dots == SCREEN_WIDTH) {
+            render_scanline(gb);
+        }
     }
 
-    if (gb->ly < SCREEN_HEIGHT && gb->dots < SCREEN_WIDTH && gb->dots >= 0) {
-        render_pixel(gb, gb->dots, gb->ly);
+    schedule(gb, EVENT_LCD, gb->lcd_time + (next_boundary(gb) - gb->dots));
+}
+
+u8 lcd_read_stat(GameBoy* gb) {
+    lcd_sync(gb);
+    u8 mode;
+    if (!gb->lcd_en) {
+        mode = 0;
+    } else if (gb->ly >= SCREEN_HEIGHT) {
+        mode = 1;
+    } else if (gb->dots < 0) {
+        mode = 2;
+    } else if (gb->dots < SCREEN_WIDTH) {
+        mode = 3;
+    } else {
+        mode = 0;
     }
-}
\ No newline at end of file
+    return 0x80 | (gb->stat & 0x78) | ((gb->ly == gb->lyc) << 2) | mode;
+}
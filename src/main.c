@@ -1,24 +1,123 @@
 #include "gb.h"
+#include "apu.h"
+#include "mapfile.h"
+#include "mbc.h"
+#include "profile.h"
+#include "rewind.h"
+#include "ring.h"
+#include "state.h"
+#include "trace.h"
+#include "tribuf.h"
 
 #define SDL_MAIN_HANDLED
 
 #include "SDL.h"
 
+#include "stdatomic.h"
 #include "stdbool.h"
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
 
 SDL_Window* window;
-SDL_Surface* framebuf;
-// Needed because you can't do a ScaledBlit directly from an 8-bit indexed
-// surface
-SDL_Surface* tempbuf;
-u8* rom;
+SDL_Renderer* renderer;
+// Finished frames are uploaded here and scaled by the renderer
+SDL_Texture* screen;
+MappedFile rom_file;
+// Battery backed cartridge RAM, shared with the .sav file next to the ROM
+MappedFile save_file;
+int frames_since_flush;
 GameBoy* gb;
+// What the core draws into, copied out once the frame is finished
+u32* emu_fbuf;
 
-SDL_Color master_palette[4] = {{0xFF, 0xFF, 0xFF, 0xFF},
-                               {0xAA, 0xAA, 0xAA, 0xFF},
-                               {0x55, 0x55, 0x55, 0xFF},
-                               {0x00, 0x00, 0x00, 0xFF}};
+// The core runs on its own thread (see emu_thread) so that a slow present or
+// a window being dragged never holds it up. Finished frames come back through
+// a triple buffer and input goes to it through a queue, neither of which
+// blocks either side.
+SDL_Thread* emu;
+atomic_bool quitting;
+TripleBuffer frames;
+Ring input;
+
+// Sent from the SDL thread to the emulation thread
+typedef enum {
+    INPUT_BUTTONS,
+    INPUT_REWIND,
+    INPUT_TURBO,
+    INPUT_PALETTE,
+    INPUT_TRACE
+} InputType;
+typedef struct {
+    u8 type;
+    u8 value;
+} InputMessage;
+#define INPUT_QUEUE_SIZE 256
+
+// Samples go to the SDL audio callback the same way, as interleaved stereo
+// s16. If the callback runs dry it plays silence, and if the queue is full the
+// newest samples are dropped, so its size bounds the latency.
+//
+// Frames are paced by the host's clock and samples are played by the sound
+// card's, which never quite agree. So the number of samples made per emulated
+// second is nudged, by up to AUDIO_MAX_SKEW either way, to keep the queue half
+// full. That's too little to hear as a change of pitch.
+SDL_AudioDeviceID audio_dev;
+Ring audio_queue;
+#define AUDIO_RATE 48000
+#define AUDIO_DEVICE_SAMPLES 512
+#define AUDIO_QUEUE_SIZE 8192
+// Enough for any one frame, even at the slowest speed
+#define AUDIO_FRAME_MAX (AUDIO_RATE / 10)
+#define AUDIO_MAX_SKEW 0.005
+s16* audio_buf;
+// Smoothed queue fill in bytes, as the callback empties it in big bites
+double audio_fill;
+
+// Held buttons, as seen by the SDL thread
+u8 held_buttons;
+
+// Emulation thread's copy of the input
+u8 buttons;
+// Held down to step backwards through the frame history
+bool rewinding;
+
+// Number of frames to run ahead of the one shown, hiding the game's own input
+// lag. The real state is saved in ahead_state while running ahead.
+int run_ahead;
+u8* ahead_state;
+size_t ahead_size;
+
+// Memory set aside for the rewind history
+#define REWIND_CAPACITY (4 << 20)
+
+// Emulation speed while Tab is held, 0 for as fast as possible
+int turbo_speed;
+bool turbo;
+
+// Frames are paced against absolute deadlines: the emulated time shown since
+// pace_origin (in nanoseconds of host time) says when the next frame is due,
+// so rounding never accumulates and the rate stays at the DMG's 59.73 Hz
+u64 pace_origin;
+u64 pace_cycles;
+
+// Tail end of each wait that is spun rather than slept, to absorb the
+// imprecision of SDL_Delay
+#define SPIN_NS 2000000
+// Falling further behind than this (e.g. the window was dragged) starts the
+// schedule over instead of rushing to catch up
+#define MAX_LAG_NS 100000000
+
+// Frames between asking the OS to write the save file back to disk
+#define SAVE_FLUSH_FRAMES 60
+
+// ARGB8888 colors of the 4 shades, lightest first. P switches between them.
+#define PALETTE_COUNT 2
+const u32 master_palettes[PALETTE_COUNT][4] = {
+    {0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000}, // Grey
+    {0xFF9BBC0F, 0xFF8BAC0F, 0xFF306230, 0xFF0F380F}, // Green, like the DMG
+};
+int palette_idx;
 
 static void try_sdl_func(int line, bool cond) {
     if (cond) {
@@ -29,44 +128,18 @@ static void try_sdl_func(int line, bool cond) {
 
 #define try_sdl(cond) try_sdl_func(__LINE__, cond)
 
-static SDL_Rect get_dest_rect(SDL_Surface* surf) {
-    int w = surf->w;
-    int h = surf->h;
-
-    if (10 * h < 9 * w) {
-        // Height is limiting
-        int tw = 10 * h / 9;
-        int margin = (w - tw) / 2;
-        SDL_Rect r = {margin, 0, tw, h};
-        return r;
-    } else if (9 * w < 10 * h) {
-        // Width is limiting
-        int th = 9 * w / 10;
-        int margin = (h - th) / 2;
-        SDL_Rect r = {0, margin, w, th};
-        return r;
-    } else {
-        SDL_Rect r = {0, 0, w, h};
-        return r;
-    }
-}
-
 static void draw() {
-    if (framebuf) {
-        SDL_UnlockSurface(framebuf);
-        try_sdl(SDL_BlitSurface(framebuf, NULL, tempbuf, NULL));
-        try_sdl(SDL_LockSurface(framebuf));
-
-        SDL_Surface* win_surf = SDL_GetWindowSurface(window);
-        SDL_Rect r = get_dest_rect(win_surf);
-
-        try_sdl(SDL_BlitScaled(tempbuf, NULL, win_surf, &r));
-    } else {
-        SDL_Surface* win_surf = SDL_GetWindowSurface(window);
-        try_sdl(SDL_FillRect(win_surf, NULL, 0));
-    }
+    // The logical size letterboxes the screen to 10:9
+    try_sdl(SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0xFF));
+    try_sdl(SDL_RenderClear(renderer));
+    try_sdl(SDL_RenderCopy(renderer, screen, NULL, NULL));
+    SDL_RenderPresent(renderer);
+}
 
-    try_sdl(SDL_UpdateWindowSurface(window));
+static void audio_callback(void* data, Uint8* stream, int len) {
+    (void)data;
+    size_t got = ring_read(&audio_queue, stream, len);
+    memset(stream + got, 0, len - got);
 }
 
 static void init() {
@@ -76,26 +149,202 @@ static void init() {
                               SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH,
                               SCREEN_HEIGHT, SDL_WINDOW_RESIZABLE);
     try_sdl(!window);
+
+    renderer = SDL_CreateRenderer(window, -1, 0);
+    try_sdl(!renderer);
+    try_sdl(SDL_RenderSetLogicalSize(renderer, SCREEN_WIDTH, SCREEN_HEIGHT));
+    screen = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                               SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH,
+                               SCREEN_HEIGHT);
+    try_sdl(!screen);
+
+    SDL_AudioSpec want = {0};
+    want.freq = AUDIO_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples = AUDIO_DEVICE_SAMPLES;
+    want.callback = audio_callback;
+    init_ring(&audio_queue, AUDIO_QUEUE_SIZE);
+    audio_buf = SDL_malloc(AUDIO_FRAME_MAX * 2 * sizeof(s16));
+    try_sdl(!audio_buf);
+    // The emulation carries on silently if there's no audio device
+    audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);
+    if (!audio_dev) {
+        printf("Warning: could not open audio device: %s\n", SDL_GetError());
+    }
 }
 
 static void quit() {
+    atomic_store(&quitting, true);
+    SDL_WaitThread(emu, NULL);
+#ifdef RONDO_PROFILE
+    profile_write("rondo-profile");
+#endif
+    if (audio_dev) {
+        SDL_CloseAudioDevice(audio_dev);
+    }
+
     destroy_gb(gb);
-    SDL_UnlockSurface(framebuf);
-    SDL_FreeSurface(framebuf);
-    SDL_FreeSurface(tempbuf);
-    SDL_free(rom);
+    if (save_file.data) {
+        flush_mapped_file(&save_file);
+        unmap_file(&save_file);
+    }
+    unmap_file(&rom_file);
+    SDL_free(ahead_state);
+    SDL_free(emu_fbuf);
+    free_tribuf(&frames);
+    free_ring(&input);
+    free_ring(&audio_queue);
+    SDL_free(audio_buf);
+    SDL_DestroyTexture(screen);
+    SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
     exit(0);
 }
 
+static u8 key_button(SDL_Keycode key) {
+    switch (key) {
+    case SDLK_RIGHT:
+        return BUTTON_RIGHT;
+    case SDLK_LEFT:
+        return BUTTON_LEFT;
+    case SDLK_UP:
+        return BUTTON_UP;
+    case SDLK_DOWN:
+        return BUTTON_DOWN;
+    case SDLK_x:
+        return BUTTON_A;
+    case SDLK_z:
+        return BUTTON_B;
+    case SDLK_RSHIFT:
+        return BUTTON_SELECT;
+    case SDLK_RETURN:
+        return BUTTON_START;
+    default:
+        return 0;
+    }
+}
+
+static u64 now_ns() {
+    static Uint64 freq;
+    if (!freq) {
+        freq = SDL_GetPerformanceFrequency();
+    }
+    Uint64 t = SDL_GetPerformanceCounter();
+    return t / freq * 1000000000 + t % freq * 1000000000 / freq;
+}
+
+static void restart_pacer() {
+    pace_origin = now_ns();
+    pace_cycles = 0;
+}
+
+// Waits until the frame that showed cycles more of emulated time is due
+static void pace(u64 cycles) {
+    u64 speed = turbo ? turbo_speed : 1;
+    if (!speed) {
+        restart_pacer();
+        return;
+    }
+
+    // Split up so that nothing overflows however long the game runs
+    pace_cycles += cycles;
+    u64 rate = CYCLES_PER_SECOND * speed;
+    u64 deadline = pace_origin + pace_cycles / rate * 1000000000 +
+                   pace_cycles % rate * 1000000000 / rate;
+
+    u64 now = now_ns();
+    if (now > deadline + MAX_LAG_NS) {
+        restart_pacer();
+        return;
+    }
+    if (now + SPIN_NS < deadline) {
+        SDL_Delay((Uint32)((deadline - now - SPIN_NS) / 1000000));
+    }
+    while (now_ns() < deadline) {
+    }
+}
+
+// Queues a change of input for the emulation thread. Messages carry the whole
+// new state, so if the queue is ever full the next one makes up for it.
+static void send_input(InputType type, u8 value) {
+    InputMessage m = {type, value};
+    if (ring_space(&input) >= sizeof(m)) {
+        ring_write(&input, &m, sizeof(m));
+    }
+}
+
+// Applies the input queued since the last frame
+static void read_input() {
+    InputMessage m;
+    while (ring_read(&input, &m, sizeof(m)) == sizeof(m)) {
+        switch (m.type) {
+        case INPUT_BUTTONS:
+            buttons = m.value;
+            break;
+        case INPUT_REWIND:
+            rewinding = m.value;
+            break;
+        case INPUT_TURBO:
+            if (turbo != m.value) {
+                // The old schedule doesn't apply at the new speed
+                turbo = m.value;
+                restart_pacer();
+            }
+            break;
+        case INPUT_PALETTE:
+            memcpy(gb->palette, master_palettes[m.value], sizeof(gb->palette));
+            break;
+#ifdef RONDO_TRACE
+        case INPUT_TRACE:
+            // Dumped from here as the ring is only written on this thread
+            if (trace_dump(TRACE_FILE)) {
+                printf("Trace written to %s\n", TRACE_FILE);
+            }
+            break;
+#endif
+        }
+    }
+}
+
 static void event_loop() {
     SDL_Event e;
+    // Comes back after a millisecond at most to look for a new frame
+    SDL_WaitEventTimeout(NULL, 1);
     while (SDL_PollEvent(&e)) {
         switch (e.type) {
         case SDL_QUIT:
             quit();
             break;
+        case SDL_KEYDOWN:
+        case SDL_KEYUP: {
+            SDL_Keycode key = e.key.keysym.sym;
+            if (key == SDLK_BACKSPACE) {
+                send_input(INPUT_REWIND, e.type == SDL_KEYDOWN);
+            } else if (key == SDLK_TAB) {
+                send_input(INPUT_TURBO, e.type == SDL_KEYDOWN);
+#ifdef RONDO_TRACE
+            } else if (key == SDLK_F12) {
+                if (e.type == SDL_KEYDOWN && !e.key.repeat) {
+                    send_input(INPUT_TRACE, 0);
+                }
+#endif
+            } else if (key == SDLK_p) {
+                if (e.type == SDL_KEYDOWN && !e.key.repeat) {
+                    palette_idx = (palette_idx + 1) % PALETTE_COUNT;
+                    send_input(INPUT_PALETTE, palette_idx);
+                }
+            } else if (key_button(key)) {
+                if (e.type == SDL_KEYDOWN) {
+                    held_buttons |= key_button(key);
+                } else {
+                    held_buttons &= ~key_button(key);
+                }
+                send_input(INPUT_BUTTONS, held_buttons);
+            }
+            break;
+        }
         case SDL_WINDOWEVENT: {
             SDL_WindowEvent we = e.window;
             if (we.event == SDL_WINDOWEVENT_EXPOSED) {
@@ -107,65 +356,182 @@ static void event_loop() {
     }
 }
 
-static void load_rom(char* filename) {
-    size_t size;
-    rom = SDL_LoadFile(filename, &size);
+// Maps the cartridge RAM onto the ROM's .sav file, so that the game's own
+// writes are what persists it. Falls back to unsaved RAM if that fails.
+static void load_save(char* rom_filename) {
+    size_t size = mbc_battery_size(gb);
+    if (!size) {
+        return;
+    }
+
+    // Same name as the ROM with the extension replaced
+    size_t len = strlen(rom_filename);
+    char* filename = SDL_malloc(len + 5);
+    try_sdl(!filename);
+    strcpy(filename, rom_filename);
+    char* ext = strrchr(filename, '.');
+    if (ext && !strpbrk(ext, "/\\")) {
+        *ext = '\0';
+    }
+    strcat(filename, ".sav");
 
-    if (!rom) {
+    if (map_save_file(&save_file, filename, size)) {
+        mbc_attach_battery(gb, save_file.data);
+    } else {
+        printf("Warning: could not open %s, the game won't be saved\n",
+               filename);
+    }
+    SDL_free(filename);
+}
+
+static void load_rom(char* filename) {
+    if (!map_file(&rom_file, filename)) {
         printf("Error: could not load file %s\n", filename);
         exit(0);
     }
 
-    gb = make_gb(rom, size);
+    gb = make_gb(rom_file.data, rom_file.size);
     if (!gb) {
         // Initialization must have failed
         printf("Failed to init rom\n");
         exit(0);
     }
+    load_save(filename);
 
-    // Create framebuffer
-    if (gb->type == DMG) {
-        framebuf = SDL_CreateRGBSurfaceWithFormat(
-            0, SCREEN_WIDTH, SCREEN_HEIGHT, 8, SDL_PIXELFORMAT_INDEX8);
-        try_sdl(!framebuf);
-        try_sdl(SDL_SetPaletteColors(framebuf->format->palette, master_palette,
-                                     0, 4));
-        // Clear framebuf
-        try_sdl(SDL_FillRect(framebuf, NULL, 0));
-
-        tempbuf = SDL_ConvertSurface(framebuf,
-                                     SDL_GetWindowSurface(window)->format, 0);
-        try_sdl(!tempbuf);
-        try_sdl(SDL_LockSurface(framebuf));
-    } else {
+    if (gb->type != DMG) {
         printf("Non-DMG not yet supported\n");
         exit(1);
     }
 
-    gb->fbuf = framebuf->pixels;
+    // The core writes ARGB8888 pixels that go straight into the texture
+    memcpy(gb->palette, master_palettes[palette_idx], sizeof(gb->palette));
+    emu_fbuf = SDL_malloc(FBUF_SIZE);
+    try_sdl(!emu_fbuf);
+    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+        // Blank until the first frame is done
+        emu_fbuf[i] = gb->palette[0];
+    }
+    try_sdl(SDL_UpdateTexture(screen, NULL, emu_fbuf, SCREEN_WIDTH * 4));
+    gb->fbuf = emu_fbuf;
+    init_tribuf(&frames, FBUF_SIZE);
+    init_ring(&input, INPUT_QUEUE_SIZE);
+    enable_rewind(gb, REWIND_CAPACITY);
+    if (audio_dev) {
+        enable_audio(gb, AUDIO_RATE);
+        SDL_PauseAudioDevice(audio_dev, 0);
+    }
+    ahead_size = state_size(gb);
+    ahead_state = SDL_malloc(ahead_size);
+    try_sdl(!ahead_state);
+}
+
+// Passes on the samples of the frame just run, and adjusts how many the next
+// one makes
+static void queue_audio() {
+    size_t count = apu_read_samples(gb, audio_buf, AUDIO_FRAME_MAX);
+    ring_write(&audio_queue, audio_buf, count * 2 * sizeof(s16));
+
+    audio_fill += (ring_available(&audio_queue) - audio_fill) / 16;
+    double error = 1 - 2 * audio_fill / AUDIO_QUEUE_SIZE;
+    set_audio_ratio(gb, 1 + AUDIO_MAX_SKEW * error);
+}
+
+// Runs the real frame without drawing it, then shows the frame run_ahead
+// frames later and goes back
+static void run_frame_ahead() {
+    gb->fbuf = NULL;
+    run_frame(gb);
+    queue_audio();
+    save_state(gb, ahead_state, ahead_size);
+
+    // Speculative frames stay out of the rewind history, and only the real
+    // frames are heard
+    RewindBuffer* history = gb->rewind;
+    AudioOut* audio = gb->audio;
+    gb->rewind = NULL;
+    gb->audio = NULL;
+    for (int i = 0; i < run_ahead; i++) {
+        if (i == run_ahead - 1) {
+            gb->fbuf = emu_fbuf;
+        }
+        run_frame(gb);
+    }
+    gb->rewind = history;
+    gb->audio = audio;
+
+    load_state(gb, ahead_state, ahead_size);
+    gb->fbuf = emu_fbuf;
+}
+
+// Runs the core until quit() says to stop
+static int emu_thread(void* data) {
+    (void)data;
+    restart_pacer();
+    while (!atomic_load(&quitting)) {
+        u64 start_cycles = gb->cycles;
+        u64 frame_cycles;
+        read_input();
+        if (rewinding) {
+            // Step back at the normal frame rate, pausing at the oldest frame
+            rewind_step(gb);
+            frame_cycles = CYCLES_PER_FRAME;
+        } else {
+            set_buttons(gb, buttons);
+            if (run_ahead > 0) {
+                run_frame_ahead();
+            } else {
+                run_frame(gb);
+                queue_audio();
+            }
+            frame_cycles = gb->cycles - start_cycles;
+        }
+        memcpy(tribuf_back(&frames), emu_fbuf, FBUF_SIZE);
+        tribuf_publish(&frames);
+
+        // Saving is left to the OS, just don't let it fall too far behind
+        if (save_file.data && ++frames_since_flush == SAVE_FLUSH_FRAMES) {
+            flush_mapped_file(&save_file);
+            frames_since_flush = 0;
+        }
+
+        pace(frame_cycles);
+    }
+    return 0;
+}
+
+// Shows the newest finished frame, if there is one that hasn't been shown
+static void present_frame() {
+    u8* frame = tribuf_take(&frames);
+    if (frame) {
+        try_sdl(SDL_UpdateTexture(screen, NULL, frame, SCREEN_WIDTH * 4));
+        draw();
+    }
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        printf("Usage: rondo.exe [filename]\n");
+    int i = 1;
+    for (; i + 2 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "--run-ahead") == 0) {
+            run_ahead = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--turbo") == 0) {
+            turbo_speed = atoi(argv[i + 1]);
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1) {
+        printf("Usage: rondo.exe [--run-ahead frames] [--turbo speed] "
+               "[filename]\n");
         exit(0);
     }
 
     init();
-    load_rom(argv[1]);
+    load_rom(argv[argc - 1]);
 
+    emu = SDL_CreateThread(emu_thread, "emulation", NULL);
+    try_sdl(!emu);
     while (true) {
-        // All timing is in millicseconds
-        Uint64 start = SDL_GetTicks64();
         event_loop();
-        run_frame(gb);
-        draw();
-        Uint64 end = SDL_GetTicks64();
-        Uint64 elapsed = end - start;
-        Uint64 target = (1000 * gb->cycles) >> 22;
-        if (elapsed < target) {
-            SDL_Delay(target - elapsed);
-        }
-        gb->cycles = 0;
+        present_frame();
     }
 }
\ No newline at end of file
@@ -0,0 +1,126 @@
+#include "mapfile.h"
+
+#ifdef _WIN32
+
+#include "windows.h"
+
+// Maps the file open as handle, which is closed either way (the mapping
+// keeps its own reference)
+static bool map_handle(MappedFile* f, HANDLE file, size_t size,
+                       bool writable) {
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (!size) {
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || !file_size.QuadPart) {
+            CloseHandle(file);
+            return false;
+        }
+        size = file_size.QuadPart;
+    }
+
+    // A writable mapping larger than the file extends it with zeros
+    DWORD protect = writable ? PAGE_READWRITE : PAGE_READONLY;
+    HANDLE mapping =
+        CreateFileMappingA(file, NULL, protect, (DWORD)((uint64_t)size >> 32),
+                           (DWORD)size, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        return false;
+    }
+    DWORD access = writable ? FILE_MAP_WRITE : FILE_MAP_READ;
+    void* data = MapViewOfFile(mapping, access, 0, 0, size);
+    if (!data) {
+        CloseHandle(mapping);
+        return false;
+    }
+    f->data = data;
+    f->size = size;
+    f->mapping = mapping;
+    return true;
+}
+
+bool map_file(MappedFile* f, const char* path) {
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    return map_handle(f, file, 0, false);
+}
+
+bool map_save_file(MappedFile* f, const char* path, size_t size) {
+    HANDLE file =
+        CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                    OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    return map_handle(f, file, size, true);
+}
+
+void flush_mapped_file(MappedFile* f) {
+    // Hands the dirty pages to the cache manager, which writes them lazily
+    FlushViewOfFile(f->data, f->size);
+}
+
+void unmap_file(MappedFile* f) {
+    UnmapViewOfFile(f->data);
+    CloseHandle(f->mapping);
+    f->data = NULL;
+    f->size = 0;
+}
+
+#else
+
+#include "fcntl.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+bool map_file(MappedFile* f, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    // The mapping stays valid after the descriptor is closed
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    f->data = data;
+    f->size = st.st_size;
+    return true;
+}
+
+bool map_save_file(MappedFile* f, const char* path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+        ((size_t)st.st_size < size && ftruncate(fd, size) < 0)) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    f->data = data;
+    f->size = size;
+    return true;
+}
+
+void flush_mapped_file(MappedFile* f) { msync(f->data, f->size, MS_ASYNC); }
+
+void unmap_file(MappedFile* f) {
+    munmap(f->data, f->size);
+    f->data = NULL;
+    f->size = 0;
+}
+
+#endif
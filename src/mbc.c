@@ -0,0 +1,281 @@
+#include "mbc.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Bank switches only repoint rom_lo, rom_hi and cartram into the ROM image
+// and cartridge RAM, and then the page table entries for the windows that
+// moved. Nothing is copied and reads and writes never check the mapper.
+
+// Cartridge RAM banks for each value of header byte 0x0149. A 2 KiB RAM
+// still gets a whole bank.
+static const u8 ram_sizes[6] = {0, 1, 1, 4, 16, 8};
+
+// The MBC3 clock counts seconds of emulated time
+#define RTC_CLOCK 4194304
+// Bits of RTC_DH besides bit 8 of the day counter
+#define RTC_HALT (1 << 6)
+#define RTC_CARRY (1 << 7)
+
+bool mbc_init(GameBoy* gb, u8* rom, size_t size) {
+    bool has_ram = false;
+    switch (rom[0x147]) {
+    case 0x00: // ROM only
+        gb->mbc = MBC_NONE;
+        break;
+    case 0x08: // ROM+RAM
+        gb->mbc = MBC_NONE;
+        has_ram = true;
+        break;
+    case 0x09: // ROM+RAM+BATTERY
+        gb->mbc = MBC_NONE;
+        has_ram = true;
+        gb->has_battery = true;
+        break;
+    case 0x01: // MBC1
+        gb->mbc = MBC1;
+        break;
+    case 0x02: // MBC1+RAM
+        gb->mbc = MBC1;
+        has_ram = true;
+        break;
+    case 0x03: // MBC1+RAM+BATTERY
+        gb->mbc = MBC1;
+        has_ram = true;
+        gb->has_battery = true;
+        break;
+    case 0x0F: // MBC3+TIMER+BATTERY
+        gb->mbc = MBC3;
+        gb->has_rtc = true;
+        gb->has_battery = true;
+        break;
+    case 0x10: // MBC3+TIMER+RAM+BATTERY
+        gb->mbc = MBC3;
+        gb->has_rtc = true;
+        has_ram = true;
+        gb->has_battery = true;
+        break;
+    case 0x11: // MBC3
+        gb->mbc = MBC3;
+        break;
+    case 0x12: // MBC3+RAM
+        gb->mbc = MBC3;
+        has_ram = true;
+        break;
+    case 0x13: // MBC3+RAM+BATTERY
+        gb->mbc = MBC3;
+        has_ram = true;
+        gb->has_battery = true;
+        break;
+    case 0x19: // MBC5
+    case 0x1C: // MBC5+RUMBLE
+        gb->mbc = MBC5;
+        break;
+    case 0x1A: // MBC5+RAM
+    case 0x1D: // MBC5+RUMBLE+RAM
+        gb->mbc = MBC5;
+        has_ram = true;
+        break;
+    case 0x1B: // MBC5+RAM+BATTERY
+    case 0x1E: // MBC5+RUMBLE+RAM+BATTERY
+        gb->mbc = MBC5;
+        has_ram = true;
+        gb->has_battery = true;
+        break;
+    default:
+        printf("Cartridge type %02x not supported\n", rom[0x147]);
+        return false;
+    }
+
+    u8 ram_size = rom[0x149];
+    if (ram_size > 5) {
+        printf("Header byte 0x0149 (ram size) must not be greater than 5\n");
+        return false;
+    }
+
+    gb->rom = rom;
+    gb->rom_banks = size / 0x4000;
+    if (has_ram && ram_sizes[ram_size]) {
+        gb->sram_banks = ram_sizes[ram_size];
+        gb->sram = crit_alloc(gb->sram_banks * 0x2000);
+    }
+    gb->rom_bank = 1;
+    return true;
+}
+
+size_t mbc_battery_size(GameBoy* gb) {
+    return gb->has_battery ? 0x2000 * gb->sram_banks : 0;
+}
+
+void mbc_attach_battery(GameBoy* gb, u8* ram) {
+    if (!gb->sram_attached) {
+        free(gb->sram);
+    }
+    gb->sram = ram;
+    gb->sram_attached = true;
+    mbc_map(gb);
+}
+
+// Points rom_lo, rom_hi and cartram at the banks the registers select
+static void select_banks(GameBoy* gb) {
+    // Bank counts are powers of two, so out of range banks wrap around
+    u16 rom_mask = gb->rom_banks - 1;
+    u16 lo_bank = 0;
+    u16 hi_bank = gb->rom_bank;
+    u8 ram_bank = gb->ram_bank;
+    if (gb->mbc == MBC1) {
+        // The 2-bit register extends the ROM bank, and in mode 1 also
+        // banks 0x0000-0x3FFF and the RAM
+        hi_bank |= gb->ram_bank << 5;
+        lo_bank = gb->bank_mode ? gb->ram_bank << 5 : 0;
+        ram_bank = gb->bank_mode ? gb->ram_bank : 0;
+    }
+    gb->rom_lo = gb->rom + 0x4000 * (lo_bank & rom_mask);
+    gb->rom_hi = gb->rom + 0x4000 * (hi_bank & rom_mask);
+
+    gb->cartram = NULL;
+    if (!gb->sram) {
+        return;
+    }
+    if (gb->mbc == MBC_NONE) {
+        gb->cartram = gb->sram;
+    } else if (gb->ram_en && !(gb->mbc == MBC3 && ram_bank >= 0x08)) {
+        gb->cartram = gb->sram + 0x2000 * (ram_bank % gb->sram_banks);
+    }
+}
+
+void mbc_map(GameBoy* gb) {
+    select_banks(gb);
+    map_pages(gb->read_map, 0x0000, 0x4000, gb->rom_lo);
+    map_pages(gb->read_map, 0x4000, 0x4000, gb->rom_hi);
+    map_pages(gb->read_map, 0xA000, 0x2000, gb->cartram);
+    map_pages(gb->write_map, 0xA000, 0x2000, gb->cartram);
+}
+
+// Remaps only the windows whose bank changed after a register write
+static void switch_banks(GameBoy* gb) {
+    u8* rom_lo = gb->rom_lo;
+    u8* rom_hi = gb->rom_hi;
+    u8* cartram = gb->cartram;
+    select_banks(gb);
+    if (gb->rom_lo != rom_lo) {
+        map_pages(gb->read_map, 0x0000, 0x4000, gb->rom_lo);
+    }
+    if (gb->rom_hi != rom_hi) {
+        map_pages(gb->read_map, 0x4000, 0x4000, gb->rom_hi);
+    }
+    if (gb->cartram != cartram) {
+        map_pages(gb->read_map, 0xA000, 0x2000, gb->cartram);
+        map_pages(gb->write_map, 0xA000, 0x2000, gb->cartram);
+    }
+}
+
+// Brings the clock up to the present. Out of range values written by the
+// game are carried over the next time it ticks.
+static void rtc_sync(GameBoy* gb) {
+    u8* rtc = gb->rtc;
+    if (rtc[RTC_DH] & RTC_HALT) {
+        gb->rtc_time = gb->cycles;
+        return;
+    }
+    u64 seconds = (gb->cycles - gb->rtc_time) / RTC_CLOCK;
+    if (!seconds) {
+        return;
+    }
+    gb->rtc_time += seconds * RTC_CLOCK;
+
+    u64 s = rtc[RTC_S] + seconds;
+    u64 m = rtc[RTC_M] + s / 60;
+    u64 h = rtc[RTC_H] + m / 60;
+    u64 d = (rtc[RTC_DL] | (rtc[RTC_DH] & 1) << 8) + h / 24;
+    rtc[RTC_S] = s % 60;
+    rtc[RTC_M] = m % 60;
+    rtc[RTC_H] = h % 24;
+    rtc[RTC_DL] = d;
+    rtc[RTC_DH] = (rtc[RTC_DH] & ~1) | ((d >> 8) & 1);
+    if (d >= 512) {
+        rtc[RTC_DH] |= RTC_CARRY;
+    }
+}
+
+void mbc_write(GameBoy* gb, u16 addr, u8 data) {
+    switch (gb->mbc) {
+    case MBC_NONE:
+        return;
+    case MBC1:
+        if (addr < 0x2000) {
+            gb->ram_en = (data & 0x0F) == 0x0A;
+        } else if (addr < 0x4000) {
+            // Bank 0 can't be selected here, it reads as bank 1
+            gb->rom_bank = (data & 0x1F) ? data & 0x1F : 1;
+        } else if (addr < 0x6000) {
+            gb->ram_bank = data & 0x03;
+        } else {
+            gb->bank_mode = data & 1;
+        }
+        break;
+    case MBC3:
+        if (addr < 0x2000) {
+            gb->ram_en = (data & 0x0F) == 0x0A;
+        } else if (addr < 0x4000) {
+            gb->rom_bank = (data & 0x7F) ? data & 0x7F : 1;
+        } else if (addr < 0x6000) {
+            gb->ram_bank = data & 0x0F;
+        } else {
+            // Writing 0 then 1 copies the clock into the readable registers
+            if (gb->has_rtc && gb->rtc_latch == 0 && data == 1) {
+                rtc_sync(gb);
+                memcpy(gb->rtc_latched, gb->rtc, RTC_COUNT);
+            }
+            gb->rtc_latch = data;
+        }
+        break;
+    case MBC5:
+        if (addr < 0x2000) {
+            gb->ram_en = (data & 0x0F) == 0x0A;
+        } else if (addr < 0x3000) {
+            gb->rom_bank = (gb->rom_bank & 0x100) | data;
+        } else if (addr < 0x4000) {
+            gb->rom_bank = (gb->rom_bank & 0xFF) | (data & 1) << 8;
+        } else if (addr < 0x6000) {
+            gb->ram_bank = data & 0x0F;
+        }
+        break;
+    }
+    switch_banks(gb);
+}
+
+// The clock register selected in place of a RAM bank, or -1
+static int rtc_reg(GameBoy* gb) {
+    if (gb->mbc != MBC3 || !gb->has_rtc || !gb->ram_en) {
+        return -1;
+    }
+    int reg = gb->ram_bank - 0x08;
+    return reg >= 0 && reg < RTC_COUNT ? reg : -1;
+}
+
+u8 mbc_read_ram(GameBoy* gb, u16 addr) {
+    if (gb->cartram) {
+        return gb->cartram[addr & 0x1FFF];
+    }
+    int reg = rtc_reg(gb);
+    return reg >= 0 ? gb->rtc_latched[reg] : 0xFF;
+}
+
+void mbc_write_ram(GameBoy* gb, u16 addr, u8 data) {
+    if (gb->cartram) {
+        gb->cartram[addr & 0x1FFF] = data;
+        return;
+    }
+    static const u8 rtc_masks[RTC_COUNT] = {0x3F, 0x3F, 0x1F, 0xFF, 0xC1};
+    int reg = rtc_reg(gb);
+    if (reg < 0) {
+        return;
+    }
+    rtc_sync(gb);
+    gb->rtc[reg] = data & rtc_masks[reg];
+    if (reg == RTC_S) {
+        // Writing the seconds restarts the current second
+        gb->rtc_time = gb->cycles;
+    }
+}
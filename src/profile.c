@@ -0,0 +1,193 @@
+#include "profile.h"
+
+#ifdef RONDO_PROFILE
+
+#include "disasm.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include "x86intrin.h"
+#define PROFILE_TSC 1
+#endif
+
+// Most ROM banks an MBC can have (MBC5), with one more bucket for code run
+// from anywhere else
+#define BANK_COUNT 512
+#define BANK_OTHER BANK_COUNT
+
+// Entries 0-255 are opcodes, 256-511 CB opcodes
+static u64 op_counts[512];
+static u64 op_ticks[512];
+static u64 pc_counts[0x10000];
+static u64 bank_counts[BANK_COUNT + 1];
+
+// Rows shown in the report's PC table
+#define TOP_PCS 32
+
+u64 profile_ticks(void) {
+#ifdef PROFILE_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// ROM bank that pc is mapped to, or BANK_OTHER if it isn't in ROM
+static int pc_bank(GameBoy* gb, u16 pc) {
+    u8* page = gb->read_map[pc >> 8];
+    if (pc >= 0x8000 || !page || page < gb->rom) {
+        return BANK_OTHER;
+    }
+    size_t bank = (page - gb->rom) / 0x4000;
+    return bank < BANK_COUNT ? (int)bank : BANK_OTHER;
+}
+
+void profile_op(GameBoy* gb, u16 pc, u8 opcode, u64 ticks) {
+    op_counts[opcode]++;
+    op_ticks[opcode] += ticks;
+    pc_counts[pc]++;
+    bank_counts[pc_bank(gb, pc)]++;
+}
+
+void profile_cb(u8 opcode, u64 ticks) {
+    op_counts[256 + opcode]++;
+    op_ticks[256 + opcode] += ticks;
+}
+
+u64 profile_count(void) {
+    u64 total = 0;
+    for (int i = 0; i < 256; i++) {
+        total += op_counts[i];
+    }
+    return total;
+}
+
+static const char* entry_name(int i) {
+    return i < 256 ? opcode_name(i) : cb_opcode_name(i - 256);
+}
+
+// Sort orders for qsort over indices
+static const u64* sort_keys;
+static int by_key_desc(const void* a, const void* b) {
+    u64 ka = sort_keys[*(const int*)a];
+    u64 kb = sort_keys[*(const int*)b];
+    return ka < kb ? 1 : ka > kb ? -1 : 0;
+}
+
+static int* sorted_indices(const u64* keys, int count) {
+    int* indices = crit_alloc(count * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        indices[i] = i;
+    }
+    sort_keys = keys;
+    qsort(indices, count, sizeof(int), by_key_desc);
+    return indices;
+}
+
+static void write_report(FILE* f) {
+    // The 0xCB entries already include the CB opcodes' time, so only the
+    // plain opcodes are totaled
+    u64 total_count = profile_count();
+    u64 total_ticks = 0;
+    for (int i = 0; i < 256; i++) {
+        total_ticks += op_ticks[i];
+    }
+    if (!total_count) {
+        fprintf(f, "Nothing was run\n");
+        return;
+    }
+
+    fprintf(f, "Opcodes by host time (CB xx also counts within CB)\n");
+    fprintf(f, "%-6s %-14s %12s %7s %14s %7s %8s\n", "op", "name", "count",
+            "count%", "ticks", "time%", "ticks/op");
+    int* ops = sorted_indices(op_ticks, 512);
+    for (int n = 0; n < 512 && op_counts[ops[n]]; n++) {
+        int i = ops[n];
+        char op[8];
+        snprintf(op, sizeof(op), i < 256 ? "%02X" : "CB %02X", i & 0xFF);
+        fprintf(f, "%-6s %-14s %12llu %6.2f%% %14llu %6.2f%% %8.1f\n", op,
+                entry_name(i), (unsigned long long)op_counts[i],
+                100.0 * op_counts[i] / total_count,
+                (unsigned long long)op_ticks[i],
+                100.0 * op_ticks[i] / total_ticks,
+                (double)op_ticks[i] / op_counts[i]);
+    }
+    free(ops);
+
+    fprintf(f, "\nMost executed PCs\n");
+    fprintf(f, "%-6s %12s %7s\n", "pc", "count", "count%");
+    int* pcs = sorted_indices(pc_counts, 0x10000);
+    for (int n = 0; n < TOP_PCS && pc_counts[pcs[n]]; n++) {
+        fprintf(f, "%04X   %12llu %6.2f%%\n", pcs[n],
+                (unsigned long long)pc_counts[pcs[n]],
+                100.0 * pc_counts[pcs[n]] / total_count);
+    }
+    free(pcs);
+
+    fprintf(f, "\nInstructions by ROM bank\n");
+    fprintf(f, "%-6s %12s %7s\n", "bank", "count", "count%");
+    int* banks = sorted_indices(bank_counts, BANK_COUNT + 1);
+    for (int n = 0; n <= BANK_COUNT && bank_counts[banks[n]]; n++) {
+        int bank = banks[n];
+        char name[8];
+        snprintf(name, sizeof(name), bank == BANK_OTHER ? "RAM" : "%03X",
+                 bank);
+        fprintf(f, "%-6s %12llu %6.2f%%\n", name,
+                (unsigned long long)bank_counts[bank],
+                100.0 * bank_counts[bank] / total_count);
+    }
+    free(banks);
+}
+
+// One row per counter: kind, index, name, count, ticks. Names are quoted as
+// they contain commas.
+static void write_csv(FILE* f) {
+    fprintf(f, "kind,index,name,count,ticks\n");
+    for (int i = 0; i < 512; i++) {
+        fprintf(f, "%s,%d,\"%s\",%llu,%llu\n", i < 256 ? "op" : "cb", i & 0xFF,
+                entry_name(i), (unsigned long long)op_counts[i],
+                (unsigned long long)op_ticks[i]);
+    }
+    for (int pc = 0; pc < 0x10000; pc++) {
+        if (pc_counts[pc]) {
+            fprintf(f, "pc,%d,,%llu,\n", pc,
+                    (unsigned long long)pc_counts[pc]);
+        }
+    }
+    for (int bank = 0; bank <= BANK_COUNT; bank++) {
+        if (bank_counts[bank]) {
+            fprintf(f, "bank,%d,\"%s\",%llu,\n", bank,
+                    bank == BANK_OTHER ? "RAM" : "",
+                    (unsigned long long)bank_counts[bank]);
+        }
+    }
+}
+
+void profile_write(const char* prefix) {
+    size_t len = strlen(prefix);
+    char* filename = crit_alloc(len + 5);
+    const char* exts[2] = {".txt", ".csv"};
+    for (int i = 0; i < 2; i++) {
+        strcpy(filename, prefix);
+        strcat(filename, exts[i]);
+        FILE* f = fopen(filename, "w");
+        if (!f) {
+            printf("Warning: could not write %s\n", filename);
+            continue;
+        }
+        if (i == 0) {
+            write_report(f);
+        } else {
+            write_csv(f);
+        }
+        fclose(f);
+    }
+    free(filename);
+}
+
+#endif
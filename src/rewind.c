@@ -0,0 +1,235 @@
+#include "rewind.h"
+#include "apu.h"
+#include "state.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Where one delta lives in the data ring
+typedef struct {
+    u32 offset;
+    u32 size;
+} RewindEntry;
+
+// Snapshots are save states taken at the end of each frame. The newest one is
+// kept in full. Every older one is only stored as the delta that turns the
+// snapshot after it back into it, so dropping the oldest delta never breaks
+// the chain.
+struct RewindBuffer {
+    size_t snapshot_size;
+    u8* head;
+    bool has_head;
+    u8* scratch;
+    u8* delta;
+
+    // Deltas are stored back to back, wrapping around to the start when the
+    // next one doesn't fit at the end
+    u8* data;
+    size_t data_size;
+    size_t write_pos;
+
+    // Circular list of deltas, oldest first
+    RewindEntry* entries;
+    size_t max_entries;
+    size_t first;
+    size_t count;
+};
+
+void enable_rewind(GameBoy* gb, size_t capacity) {
+    if (gb->rewind) {
+        return;
+    }
+    RewindBuffer* r = crit_alloc(sizeof(RewindBuffer));
+    r->snapshot_size = state_size(gb);
+    r->head = crit_alloc(r->snapshot_size);
+    r->scratch = crit_alloc(r->snapshot_size);
+    // Worst case of encode_delta, see there
+    r->delta =
+        crit_alloc(r->snapshot_size + 8 * (r->snapshot_size / 0xFFFF + 1));
+    r->data = crit_alloc(capacity);
+    r->data_size = capacity;
+    // Even a quiet frame's delta is a few dozen bytes
+    r->max_entries = capacity / 64 + 1;
+    r->entries = crit_alloc(r->max_entries * sizeof(RewindEntry));
+    gb->rewind = r;
+}
+
+void free_rewind(GameBoy* gb) {
+    RewindBuffer* r = gb->rewind;
+    if (r) {
+        free(r->head);
+        free(r->scratch);
+        free(r->delta);
+        free(r->data);
+        free(r->entries);
+        free(r);
+        gb->rewind = NULL;
+    }
+}
+
+static bool matches4(const u8* a, const u8* b) {
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && a[3] == b[3];
+}
+
+// Run-length encodes a XOR b as chunks of [u16 equal bytes][u16 literal
+// bytes][literals], little endian. A literal only ends at 4 equal bytes in a
+// row or at the length limit, so the output is never more than
+// size + 8 * (size / 0xFFFF + 1) bytes.
+static size_t encode_delta(const u8* a, const u8* b, size_t size, u8* out) {
+    u8* p = out;
+    size_t i = 0;
+    while (i < size) {
+        size_t start = i;
+        // Most of a snapshot doesn't change, skip over it a word at a time
+        while (i + 8 <= size && i - start <= 0xFFFF - 8 &&
+               memcmp(a + i, b + i, 8) == 0) {
+            i += 8;
+        }
+        while (i < size && i - start < 0xFFFF && a[i] == b[i]) {
+            i++;
+        }
+        size_t equal = i - start;
+
+        start = i;
+        size_t end = i;
+        while (i < size && i - start < 0xFFFF) {
+            if (a[i] != b[i]) {
+                end = ++i;
+            } else if (i + 4 <= size && matches4(a + i, b + i)) {
+                break;
+            } else {
+                i++;
+            }
+        }
+        // Equal bytes at the end of the literal go into the next chunk
+        i = end;
+        size_t literal = end - start;
+
+        p[0] = equal;
+        p[1] = equal >> 8;
+        p[2] = literal;
+        p[3] = literal >> 8;
+        p += 4;
+        for (size_t j = start; j < end; j++) {
+            *p++ = a[j] ^ b[j];
+        }
+    }
+    return p - out;
+}
+
+static void apply_delta(u8* dst, const u8* delta, size_t size) {
+    const u8* end = delta + size;
+    while (delta < end) {
+        dst += delta[0] | delta[1] << 8;
+        size_t literal = delta[2] | delta[3] << 8;
+        delta += 4;
+        for (size_t i = 0; i < literal; i++) {
+            *dst++ ^= *delta++;
+        }
+    }
+}
+
+static void drop_oldest(RewindBuffer* r) {
+    r->first = (r->first + 1) % r->max_entries;
+    r->count--;
+}
+
+// Finds room for size bytes after the newest delta, dropping as many of the
+// oldest deltas as it takes. Returns the offset, or -1 if it can't fit at all.
+static long reserve(RewindBuffer* r, size_t size) {
+    if (size > r->data_size) {
+        r->count = 0;
+        return -1;
+    }
+    if (r->count == r->max_entries) {
+        drop_oldest(r);
+    }
+    if (r->count == 0) {
+        r->write_pos = 0;
+    }
+
+    size_t pos = r->write_pos;
+    bool wrap = pos + size > r->data_size;
+    while (r->count > 0) {
+        RewindEntry* oldest = &r->entries[r->first];
+        bool overlaps;
+        if (wrap) {
+            // Everything up to the end is older than what's at the start
+            overlaps = oldest->offset >= pos || oldest->offset < size;
+        } else {
+            overlaps = oldest->offset < pos + size &&
+                       oldest->offset + oldest->size > pos;
+        }
+        if (!overlaps) {
+            break;
+        }
+        drop_oldest(r);
+    }
+    return wrap ? 0 : pos;
+}
+
+void rewind_push(GameBoy* gb) {
+    RewindBuffer* r = gb->rewind;
+    if (!r->has_head) {
+        save_state(gb, r->head, r->snapshot_size);
+        r->has_head = true;
+        return;
+    }
+
+    save_state(gb, r->scratch, r->snapshot_size);
+    size_t size = encode_delta(r->head, r->scratch, r->snapshot_size, r->delta);
+    long pos = reserve(r, size);
+    if (pos >= 0) {
+        memcpy(r->data + pos, r->delta, size);
+        size_t last = (r->first + r->count) % r->max_entries;
+        RewindEntry* entry = &r->entries[last];
+        entry->offset = pos;
+        entry->size = size;
+        r->count++;
+        r->write_pos = pos + size;
+    }
+
+    u8* old_head = r->head;
+    r->head = r->scratch;
+    r->scratch = old_head;
+}
+
+bool rewind_step(GameBoy* gb) {
+    RewindBuffer* r = gb->rewind;
+    if (!r || r->count == 0) {
+        return false;
+    }
+
+    // Nothing here is heard, the output picks up from wherever it ends
+    AudioOut* audio = gb->audio;
+    gb->audio = NULL;
+    r->count--;
+    RewindEntry* entry = &r->entries[(r->first + r->count) % r->max_entries];
+    apply_delta(r->head, r->data + entry->offset, entry->size);
+    r->write_pos = entry->offset;
+
+    if (r->count == 0) {
+        // Oldest frame, there's nothing to redraw it from
+        load_state(gb, r->head, r->snapshot_size);
+        gb->audio = audio;
+        apu_resync(gb);
+        return true;
+    }
+
+    // The framebuffer isn't part of the snapshots, so redraw it by running
+    // the frame again from the one before, with the buttons that were held
+    // during it. Emulation is deterministic, so this ends up exactly in the
+    // state at the head.
+    load_state(gb, r->head, r->snapshot_size);
+    u8 buttons = gb->buttons;
+    entry = &r->entries[(r->first + r->count - 1) % r->max_entries];
+    memcpy(r->scratch, r->head, r->snapshot_size);
+    apply_delta(r->scratch, r->data + entry->offset, entry->size);
+    load_state(gb, r->scratch, r->snapshot_size);
+    set_buttons(gb, buttons);
+    gb->rewind = NULL;
+    run_frame(gb);
+    gb->rewind = r;
+    gb->audio = audio;
+    apu_resync(gb);
+    return true;
+}
@@ -0,0 +1,60 @@
+#include "ring.h"
+#include "stdlib.h"
+#include "string.h"
+
+void init_ring(Ring* ring, size_t size) {
+    ring->data = crit_alloc(size);
+    ring->size = size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+void free_ring(Ring* ring) {
+    free(ring->data);
+    ring->data = NULL;
+}
+
+// The acquire loads of the other side's index pair with its release stores,
+// so the bytes it wrote (or finished reading) are visible before the index
+// says so
+
+size_t ring_space(Ring* ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return ring->size - (head - tail);
+}
+
+size_t ring_available(Ring* ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return head - tail;
+}
+
+size_t ring_write(Ring* ring, const void* data, size_t size) {
+    size_t space = ring_space(ring);
+    if (size > space) {
+        size = space;
+    }
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t pos = head & (ring->size - 1);
+    // In up to two pieces if it wraps around the end
+    size_t first = ring->size - pos < size ? ring->size - pos : size;
+    memcpy(ring->data + pos, data, first);
+    memcpy(ring->data, (const u8*)data + first, size - first);
+    atomic_store_explicit(&ring->head, head + size, memory_order_release);
+    return size;
+}
+
+size_t ring_read(Ring* ring, void* data, size_t size) {
+    size_t available = ring_available(ring);
+    if (size > available) {
+        size = available;
+    }
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t pos = tail & (ring->size - 1);
+    size_t first = ring->size - pos < size ? ring->size - pos : size;
+    memcpy(data, ring->data + pos, first);
+    memcpy((u8*)data + first, ring->data, size - first);
+    atomic_store_explicit(&ring->tail, tail + size, memory_order_release);
+    return size;
+}
@@ -0,0 +1,269 @@
+#include "simd.h"
+#include "string.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RONDO_X86_SIMD 1
+#include "immintrin.h"
+#else
+#define RONDO_X86_SIMD 0
+#endif
+
+// Expands one byte of a tile's bitplane into 8 pixels, one per byte, with the
+// leftmost pixel (bit 7) first in memory
+#if RONDO_BIG_ENDIAN
+#define SPREAD(B)                                                              \
+    (((u64)((B) >> 7 & 1) << 56) | ((u64)((B) >> 6 & 1) << 48) |              \
+     ((u64)((B) >> 5 & 1) << 40) | ((u64)((B) >> 4 & 1) << 32) |              \
+     ((u64)((B) >> 3 & 1) << 24) | ((u64)((B) >> 2 & 1) << 16) |              \
+     ((u64)((B) >> 1 & 1) << 8) | ((u64)((B) >> 0 & 1) << 0))
+#else
+#define SPREAD(B)                                                              \
+    (((u64)((B) >> 7 & 1) << 0) | ((u64)((B) >> 6 & 1) << 8) |                \
+     ((u64)((B) >> 5 & 1) << 16) | ((u64)((B) >> 4 & 1) << 24) |              \
+     ((u64)((B) >> 3 & 1) << 32) | ((u64)((B) >> 2 & 1) << 40) |              \
+     ((u64)((B) >> 1 & 1) << 48) | ((u64)((B) >> 0 & 1) << 56))
+#endif
+#define SPREAD4(B) SPREAD(B), SPREAD(B + 1), SPREAD(B + 2), SPREAD(B + 3)
+#define SPREAD16(B) SPREAD4(B), SPREAD4(B + 4), SPREAD4(B + 8), SPREAD4(B + 12)
+#define SPREAD64(B)                                                            \
+    SPREAD16(B), SPREAD16(B + 16), SPREAD16(B + 32), SPREAD16(B + 48)
+static const u64 spread_lut[256] = {SPREAD64(0), SPREAD64(64), SPREAD64(128),
+                                    SPREAD64(192)};
+
+static void decode_tile_rows_scalar(const u8* src, u8* dst, int rows) {
+    for (int i = 0; i < rows; i++) {
+        u64 pixels = spread_lut[src[2 * i]] | (spread_lut[src[2 * i + 1]] << 1);
+        memcpy(dst + 8 * i, &pixels, 8);
+    }
+}
+
+#if RONDO_X86_SIMD
+// Each output byte tests one bit of its row's plane byte, leftmost pixel first
+#define BIT_MASKS 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
+
+// Turns two rows' worth of broadcast plane bytes into 16 color indices
+__attribute__((target("sse2"))) static inline __m128i
+sse2_combine(__m128i lsb, __m128i msb) {
+    const __m128i mask = _mm_setr_epi8(BIT_MASKS, BIT_MASKS);
+    lsb = _mm_cmpeq_epi8(_mm_and_si128(lsb, mask), mask);
+    msb = _mm_cmpeq_epi8(_mm_and_si128(msb, mask), mask);
+    return _mm_or_si128(_mm_and_si128(lsb, _mm_set1_epi8(1)),
+                        _mm_and_si128(msb, _mm_set1_epi8(2)));
+}
+
+// 8 rows (one full tile) per iteration, 16 pixels per store
+__attribute__((target("sse2"))) static void
+decode_tile_rows_sse2(const u8* src, u8* dst, int rows) {
+    for (; rows >= 8; rows -= 8, src += 16, dst += 64) {
+        __m128i x = _mm_loadu_si128((const __m128i*)src);
+        // Split the interleaved planes: lsb bytes low, msb bytes high
+        __m128i planes =
+            _mm_packus_epi16(_mm_and_si128(x, _mm_set1_epi16(0xFF)),
+                             _mm_srli_epi16(x, 8));
+
+        // Broadcast every plane byte across the 8 pixels it covers
+        __m128i lsb2 = _mm_unpacklo_epi8(planes, planes);
+        __m128i msb2 = _mm_unpackhi_epi8(planes, planes);
+        __m128i lsb4_lo = _mm_unpacklo_epi16(lsb2, lsb2);
+        __m128i lsb4_hi = _mm_unpackhi_epi16(lsb2, lsb2);
+        __m128i msb4_lo = _mm_unpacklo_epi16(msb2, msb2);
+        __m128i msb4_hi = _mm_unpackhi_epi16(msb2, msb2);
+
+        _mm_storeu_si128((__m128i*)(dst + 0),
+                         sse2_combine(_mm_unpacklo_epi32(lsb4_lo, lsb4_lo),
+                                      _mm_unpacklo_epi32(msb4_lo, msb4_lo)));
+        _mm_storeu_si128((__m128i*)(dst + 16),
+                         sse2_combine(_mm_unpackhi_epi32(lsb4_lo, lsb4_lo),
+                                      _mm_unpackhi_epi32(msb4_lo, msb4_lo)));
+        _mm_storeu_si128((__m128i*)(dst + 32),
+                         sse2_combine(_mm_unpacklo_epi32(lsb4_hi, lsb4_hi),
+                                      _mm_unpacklo_epi32(msb4_hi, msb4_hi)));
+        _mm_storeu_si128((__m128i*)(dst + 48),
+                         sse2_combine(_mm_unpackhi_epi32(lsb4_hi, lsb4_hi),
+                                      _mm_unpackhi_epi32(msb4_hi, msb4_hi)));
+    }
+    decode_tile_rows_scalar(src, dst, rows);
+}
+
+// 8 rows (one full tile) per iteration, 32 pixels per store
+__attribute__((target("avx2"))) static void
+decode_tile_rows_avx2(const u8* src, u8* dst, int rows) {
+    const __m256i mask = _mm256_setr_epi8(BIT_MASKS, BIT_MASKS, BIT_MASKS,
+                                          BIT_MASKS);
+    // Shuffle indices that broadcast each row's plane byte; each 128-bit lane
+    // handles two rows and both lanes hold a copy of the whole tile
+    const __m256i lsb_lo = _mm256_setr_epi8(
+        0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+        6, 6, 6, 6, 6, 6, 6, 6);
+    const __m256i lsb_hi = _mm256_add_epi8(lsb_lo, _mm256_set1_epi8(8));
+    const __m256i one = _mm256_set1_epi8(1);
+
+    for (; rows >= 8; rows -= 8, src += 16, dst += 64) {
+        __m256i x = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i*)src));
+
+        for (int half = 0; half < 2; half++) {
+            __m256i idx = half ? lsb_hi : lsb_lo;
+            __m256i lsb = _mm256_shuffle_epi8(x, idx);
+            __m256i msb = _mm256_shuffle_epi8(x, _mm256_add_epi8(idx, one));
+            lsb = _mm256_cmpeq_epi8(_mm256_and_si256(lsb, mask), mask);
+            msb = _mm256_cmpeq_epi8(_mm256_and_si256(msb, mask), mask);
+            __m256i out =
+                _mm256_or_si256(_mm256_and_si256(lsb, one),
+                                _mm256_and_si256(msb, _mm256_set1_epi8(2)));
+            _mm256_storeu_si256((__m256i*)(dst + 32 * half), out);
+        }
+    }
+    decode_tile_rows_scalar(src, dst, rows);
+}
+#endif
+
+static void expand_palette_scalar(const u8* src, u32* dst, int count,
+                                  const u32 lut[4]) {
+    for (int i = 0; i < count; i++) {
+        dst[i] = lut[src[i] & 3];
+    }
+}
+
+#if RONDO_X86_SIMD
+// 4 pixels per iteration, each selected from the 4 colors by comparison
+__attribute__((target("sse2"))) static void
+expand_palette_sse2(const u8* src, u32* dst, int count, const u32 lut[4]) {
+    const __m128i zero = _mm_setzero_si128();
+    for (; count >= 4; count -= 4, src += 4, dst += 4) {
+        u32 four;
+        memcpy(&four, src, 4);
+        __m128i idx = _mm_cvtsi32_si128(four);
+        idx = _mm_unpacklo_epi16(_mm_unpacklo_epi8(idx, zero), zero);
+        __m128i out = zero;
+        for (int i = 0; i < 4; i++) {
+            __m128i hit = _mm_cmpeq_epi32(idx, _mm_set1_epi32(i));
+            out = _mm_or_si128(out,
+                               _mm_and_si128(hit, _mm_set1_epi32(lut[i])));
+        }
+        _mm_storeu_si128((__m128i*)dst, out);
+    }
+    expand_palette_scalar(src, dst, count, lut);
+}
+
+// 8 pixels per iteration, the indices permute a register holding the colors
+__attribute__((target("avx2"))) static void
+expand_palette_avx2(const u8* src, u32* dst, int count, const u32 lut[4]) {
+    const __m256i colors = _mm256_setr_epi32(lut[0], lut[1], lut[2], lut[3],
+                                             lut[0], lut[1], lut[2], lut[3]);
+    for (; count >= 8; count -= 8, src += 8, dst += 8) {
+        __m256i idx =
+            _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)src));
+        _mm256_storeu_si256((__m256i*)dst,
+                            _mm256_permutevar8x32_epi32(colors, idx));
+    }
+    expand_palette_scalar(src, dst, count, lut);
+}
+#endif
+
+static void add_scaled_scalar(float* dst, const float* src, float scale,
+                              int count) {
+    for (int i = 0; i < count; i++) {
+        dst[i] += src[i] * scale;
+    }
+}
+
+#if RONDO_X86_SIMD
+// Multiply and add are kept separate (no FMA) to round like the plain loop
+__attribute__((target("sse2"))) static void
+add_scaled_sse2(float* dst, const float* src, float scale, int count) {
+    const __m128 s = _mm_set1_ps(scale);
+    for (; count >= 4; count -= 4, src += 4, dst += 4) {
+        __m128 x = _mm_mul_ps(_mm_loadu_ps(src), s);
+        _mm_storeu_ps(dst, _mm_add_ps(_mm_loadu_ps(dst), x));
+    }
+    add_scaled_scalar(dst, src, scale, count);
+}
+
+__attribute__((target("avx2"))) static void
+add_scaled_avx2(float* dst, const float* src, float scale, int count) {
+    const __m256 s = _mm256_set1_ps(scale);
+    for (; count >= 8; count -= 8, src += 8, dst += 8) {
+        __m256 x = _mm256_mul_ps(_mm256_loadu_ps(src), s);
+        _mm256_storeu_ps(dst, _mm256_add_ps(_mm256_loadu_ps(dst), x));
+    }
+    add_scaled_scalar(dst, src, scale, count);
+}
+#endif
+
+typedef void (*DecodeFuncPtr)(const u8*, u8*, int);
+
+// Picks the best implementation on first use
+static void decode_tile_rows_init(const u8* src, u8* dst, int rows);
+static DecodeFuncPtr decode_impl = decode_tile_rows_init;
+
+static void decode_tile_rows_init(const u8* src, u8* dst, int rows) {
+    decode_impl = decode_tile_rows_scalar;
+#if RONDO_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        decode_impl = decode_tile_rows_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        decode_impl = decode_tile_rows_sse2;
+    }
+#endif
+    decode_impl(src, dst, rows);
+}
+
+void decode_tile_rows(const u8* src, u8* dst, int rows) {
+    decode_impl(src, dst, rows);
+}
+
+typedef void (*ExpandFuncPtr)(const u8*, u32*, int, const u32[4]);
+
+static void expand_palette_init(const u8* src, u32* dst, int count,
+                                const u32 lut[4]);
+static ExpandFuncPtr expand_impl = expand_palette_init;
+
+static void expand_palette_init(const u8* src, u32* dst, int count,
+                                const u32 lut[4]) {
+    expand_impl = expand_palette_scalar;
+#if RONDO_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        expand_impl = expand_palette_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        expand_impl = expand_palette_sse2;
+    }
+#endif
+    expand_impl(src, dst, count, lut);
+}
+
+void expand_palette(const u8* src, u32* dst, int count, const u8 shades[4],
+                    const u32 colors[4]) {
+    // Both lookups are folded into one table of final colors
+    u32 lut[4];
+    for (int i = 0; i < 4; i++) {
+        lut[i] = colors[shades[i] & 3];
+    }
+    expand_impl(src, dst, count, lut);
+}
+
+typedef void (*AddScaledFuncPtr)(float*, const float*, float, int);
+
+static void add_scaled_init(float* dst, const float* src, float scale,
+                            int count);
+static AddScaledFuncPtr add_scaled_impl = add_scaled_init;
+
+static void add_scaled_init(float* dst, const float* src, float scale,
+                            int count) {
+    add_scaled_impl = add_scaled_scalar;
+#if RONDO_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        add_scaled_impl = add_scaled_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        add_scaled_impl = add_scaled_sse2;
+    }
+#endif
+    add_scaled_impl(dst, src, scale, count);
+}
+
+void add_scaled(float* dst, const float* src, float scale, int count) {
+    add_scaled_impl(dst, src, scale, count);
+}
@@ -0,0 +1,229 @@
+#include "state.h"
+#include "block.h"
+#include "stdio.h"
+#include "string.h"
+
+// Every save state starts with this, followed by the version, the model, a
+// reserved byte and the cartridge header's checksums (0x14D-0x14F), which
+// tell games apart
+static const u8 state_magic[4] = {'R', 'N', 'D', 'O'};
+#define HEADER_SIZE 12
+
+// The same walk over the fields either measures, writes or reads them, so
+// that the three can't drift apart. Multi-byte values are little endian.
+typedef enum { STATE_MEASURE, STATE_SAVE, STATE_LOAD } StateMode;
+
+typedef struct {
+    StateMode mode;
+    u8* p;
+    size_t size;
+} StateStream;
+
+static void sync_bytes(StateStream* s, void* data, size_t size) {
+    if (s->mode == STATE_SAVE) {
+        memcpy(s->p, data, size);
+        s->p += size;
+    } else if (s->mode == STATE_LOAD) {
+        memcpy(data, s->p, size);
+        s->p += size;
+    }
+    s->size += size;
+}
+
+// Like sync_bytes, but loading only writes the pages that differ. The
+// cartridge RAM can be a view of the save file, and a restore that rewrites
+// all of it would dirty every page for the OS to write back.
+#define SYNC_PAGE 4096
+static void sync_mapped(StateStream* s, u8* data, size_t size) {
+    if (s->mode != STATE_LOAD) {
+        sync_bytes(s, data, size);
+        return;
+    }
+    for (size_t i = 0; i < size; i += SYNC_PAGE) {
+        size_t n = size - i < SYNC_PAGE ? size - i : SYNC_PAGE;
+        if (memcmp(data + i, s->p + i, n) != 0) {
+            memcpy(data + i, s->p + i, n);
+        }
+    }
+    s->p += size;
+    s->size += size;
+}
+
+static void sync_u8(StateStream* s, u8* v) { sync_bytes(s, v, 1); }
+
+static void sync_bool(StateStream* s, bool* v) {
+    u8 byte = *v;
+    sync_u8(s, &byte);
+    *v = byte != 0;
+}
+
+static void sync_u16(StateStream* s, u16* v) {
+    u8 bytes[2] = {*v, *v >> 8};
+    sync_bytes(s, bytes, 2);
+    *v = bytes[0] | bytes[1] << 8;
+}
+
+static void sync_u32(StateStream* s, u32* v) {
+    u8 bytes[4] = {*v, *v >> 8, *v >> 16, *v >> 24};
+    sync_bytes(s, bytes, 4);
+    *v = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (u32)bytes[3] << 24;
+}
+
+static void sync_u64(StateStream* s, u64* v) {
+    u8 bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = *v >> (8 * i);
+    }
+    sync_bytes(s, bytes, 8);
+    *v = 0;
+    for (int i = 0; i < 8; i++) {
+        *v |= (u64)bytes[i] << (8 * i);
+    }
+}
+
+static void sync_state(StateStream* s, GameBoy* gb) {
+    // CPU
+    sync_u8(s, &gb->a);
+    sync_u8(s, &gb->f_zres);
+    sync_bool(s, &gb->f_n);
+    sync_u8(s, &gb->f_hres);
+    sync_u16(s, &gb->f_cres);
+    sync_u16(s, &gb->pc);
+    sync_u16(s, &gb->sp);
+    sync_u16(s, &gb->bc);
+    sync_u16(s, &gb->de);
+    sync_u16(s, &gb->hl);
+    sync_bool(s, &gb->ime);
+    sync_bool(s, &gb->halted);
+    sync_bool(s, &gb->halt_bug);
+
+    // IO
+    sync_u8(s, &gb->p1_sel);
+    sync_u8(s, &gb->buttons);
+    sync_u8(s, &gb->sb);
+    sync_u8(s, &gb->sc);
+    sync_u64(s, &gb->div_epoch);
+    sync_u8(s, &gb->tima);
+    sync_u64(s, &gb->timer_time);
+    sync_u8(s, &gb->tma);
+    sync_bool(s, &gb->tac_en);
+    sync_u8(s, &gb->tac_clk);
+    sync_u8(s, &gb->if_);
+    sync_bool(s, &gb->lcd_en);
+    sync_bool(s, &gb->win_map);
+    sync_bool(s, &gb->win_en);
+    sync_bool(s, &gb->tile_sel);
+    sync_bool(s, &gb->bg_map);
+    sync_bool(s, &gb->obj_size);
+    sync_bool(s, &gb->obj_en);
+    sync_bool(s, &gb->bg_en);
+    sync_u8(s, &gb->stat);
+    sync_u8(s, &gb->scy);
+    sync_u8(s, &gb->scx);
+    sync_u8(s, &gb->ly);
+    sync_u8(s, &gb->lyc);
+    sync_u8(s, &gb->dma);
+    sync_bytes(s, gb->bgp, 4);
+    sync_bytes(s, gb->obp0, 4);
+    sync_bytes(s, gb->obp1, 4);
+    sync_u8(s, &gb->wy);
+    sync_u8(s, &gb->wx);
+    sync_u8(s, &gb->ie);
+
+    // Sound
+    sync_bytes(s, gb->nr, sizeof(gb->nr));
+    sync_bytes(s, gb->wave_ram, sizeof(gb->wave_ram));
+    sync_bool(s, &gb->apu_on);
+    for (int i = 0; i < 4; i++) {
+        sync_bool(s, &gb->ch[i].on);
+        sync_u16(s, &gb->ch[i].length);
+        sync_u8(s, &gb->ch[i].volume);
+        sync_u8(s, &gb->ch[i].env_timer);
+        sync_u8(s, &gb->ch[i].pos);
+        sync_u32(s, &gb->ch[i].timer);
+    }
+    sync_u16(s, &gb->sweep_freq);
+    sync_u8(s, &gb->sweep_timer);
+    sync_bool(s, &gb->sweep_en);
+    sync_u16(s, &gb->lfsr);
+    sync_u8(s, &gb->seq_step);
+
+    // Cartridge
+    sync_bool(s, &gb->ram_en);
+    sync_u16(s, &gb->rom_bank);
+    sync_u8(s, &gb->ram_bank);
+    sync_bool(s, &gb->bank_mode);
+    sync_u8(s, &gb->rtc_latch);
+    sync_bytes(s, gb->rtc, RTC_COUNT);
+    sync_u64(s, &gb->rtc_time);
+    sync_bytes(s, gb->rtc_latched, RTC_COUNT);
+
+    // Timing
+    sync_u64(s, &gb->cycles);
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        sync_u64(s, &gb->events[i]);
+    }
+    sync_u16(s, (u16*)&gb->dots);
+    sync_u64(s, &gb->lcd_time);
+    sync_u64(s, &gb->apu_time);
+
+    // Memory
+    sync_bytes(s, gb->vram, gb->type == CGB ? 0x4000 : 0x2000);
+    sync_bytes(s, gb->wram_lo, gb->type == CGB ? 0x8000 : 0x2000);
+    sync_bytes(s, gb->oam, 0xA0);
+    sync_bytes(s, gb->hram, 0x7F);
+    if (gb->sram) {
+        sync_mapped(s, gb->sram, 0x2000 * gb->sram_banks);
+    }
+}
+
+size_t state_size(GameBoy* gb) {
+    StateStream s = {STATE_MEASURE, NULL, HEADER_SIZE};
+    sync_state(&s, gb);
+    return s.size;
+}
+
+bool save_state(GameBoy* gb, u8* buf, size_t size) {
+    if (size < state_size(gb)) {
+        return false;
+    }
+    memcpy(buf, state_magic, 4);
+    u16 version = STATE_VERSION;
+    u8 header[8] = {version, version >> 8, gb->type, 0,
+                    gb->rom[0x14D], gb->rom[0x14E], gb->rom[0x14F], 0};
+    memcpy(buf + 4, header, 8);
+
+    StateStream s = {STATE_SAVE, buf + HEADER_SIZE, HEADER_SIZE};
+    sync_state(&s, gb);
+    return true;
+}
+
+bool load_state(GameBoy* gb, const u8* buf, size_t size) {
+    if (size != state_size(gb) || memcmp(buf, state_magic, 4) != 0) {
+        printf("Not a Rondo save state of this size\n");
+        return false;
+    }
+    u16 version = buf[4] | buf[5] << 8;
+    if (version != STATE_VERSION) {
+        printf("Save state version %d is not supported\n", version);
+        return false;
+    }
+    if (buf[6] != gb->type) {
+        printf("Save state is for a different Game Boy model\n");
+        return false;
+    }
+    if (memcmp(buf + 8, gb->rom + 0x14D, 3) != 0) {
+        printf("Save state is for a different game\n");
+        return false;
+    }
+
+    StateStream s = {STATE_LOAD, (u8*)buf + HEADER_SIZE, HEADER_SIZE};
+    sync_state(&s, gb);
+
+    // Rebuild everything derived from the restored state
+    schedule(gb, EVENT_LCD, gb->events[EVENT_LCD]); // Recomputes next_event
+    map_memory(gb); // Also selects the restored banks
+    block_drop_ram(gb);
+    memset(gb->tile_dirty, true, sizeof(gb->tile_dirty));
+    return true;
+}
@@ -0,0 +1,128 @@
+#include "timer.h"
+#include "apu.h"
+
+// Nothing here runs per cycle. DIV is the top half of a 16-bit counter that
+// started at div_epoch, and TIMA counts the falling edges of one of its bits
+// (ANDed with the enable bit) since timer_time. The only event is the TIMA
+// reload, scheduled for when the count will overflow.
+
+// Distance between falling edges of the divider bit each TAC clock selects
+static const u16 timer_periods[4] = {1024, 16, 64, 256};
+
+static u64 period(GameBoy* gb) { return timer_periods[gb->tac_clk]; }
+
+static u16 divider(GameBoy* gb) { return gb->cycles - gb->div_epoch; }
+
+// Whether the selected divider bit is set and the timer is enabled
+static bool timer_input(GameBoy* gb) {
+    return gb->tac_en && (divider(gb) & (period(gb) / 2));
+}
+
+// Brings TIMA up to the present. Never runs past an overflow, since the
+// reload event falls due one M-cycle after it.
+static void timer_sync(GameBoy* gb) {
+    if (gb->tac_en) {
+        u64 p = period(gb);
+        u64 edges = (gb->cycles - gb->div_epoch) / p -
+                    (gb->timer_time - gb->div_epoch) / p;
+        gb->tima += edges;
+    }
+    gb->timer_time = gb->cycles;
+}
+
+// Whether TIMA has overflowed and reads 0 until the reload
+static bool reload_pending(GameBoy* gb) {
+    return gb->events[EVENT_TIMER] != NEVER &&
+           gb->cycles + 4 >= gb->events[EVENT_TIMER];
+}
+
+// Schedules the reload for the edge that will take TIMA past 0xFF
+static void timer_schedule(GameBoy* gb) {
+    if (!gb->tac_en) {
+        schedule(gb, EVENT_TIMER, NEVER);
+        return;
+    }
+    u64 p = period(gb);
+    u64 first_edge =
+        gb->div_epoch + ((gb->timer_time - gb->div_epoch) / p + 1) * p;
+    u64 overflow = first_edge + (0xFF - gb->tima) * p;
+    schedule(gb, EVENT_TIMER, overflow + 4);
+}
+
+// Reschedules after a DIV or TAC write, which may have caused an edge
+static void timer_update(GameBoy* gb, bool edge) {
+    if (reload_pending(gb)) {
+        // The reload goes ahead as scheduled
+        return;
+    }
+    if (edge && ++gb->tima == 0) {
+        schedule(gb, EVENT_TIMER, gb->cycles + 4);
+    } else {
+        timer_schedule(gb);
+    }
+}
+
+void timer_reload(GameBoy* gb) {
+    timer_sync(gb);
+    gb->tima = gb->tma;
+    gb->if_ |= (1 << 2);
+    timer_schedule(gb);
+}
+
+u8 timer_read(GameBoy* gb, u8 addr) {
+    switch (addr) {
+    case 0x04: // DIV (FF04)
+        return divider(gb) >> 8;
+    case 0x05: // TIMA (FF05)
+        timer_sync(gb);
+        return gb->tima;
+    case 0x06: // TMA (FF06)
+        return gb->tma;
+    default: // TAC (FF07)
+        return (gb->tac_en << 2) | gb->tac_clk | 0xF8;
+    }
+}
+
+void timer_write(GameBoy* gb, u8 addr, u8 data) {
+    timer_sync(gb);
+    switch (addr) {
+    case 0x04: { // DIV (FF04)
+        // Clearing the divider is a falling edge if the selected bit was set
+        bool edge = timer_input(gb);
+        bool seq_edge = divider(gb) & (1 << 12);
+        gb->div_epoch = gb->cycles;
+        timer_update(gb, edge);
+        apu_div_reset(gb, seq_edge);
+        break;
+    }
+    case 0x05: // TIMA (FF05)
+        // Writing during the delay after an overflow cancels the reload
+        gb->tima = data;
+        timer_schedule(gb);
+        break;
+    case 0x06: // TMA (FF06)
+        // A pending reload picks up the new value
+        gb->tma = data;
+        break;
+    case 0x07: { // TAC (FF07)
+        // The timer sees a falling edge if the bit it was watching goes from
+        // set to clear, whether by selecting another bit or disabling it
+        bool before = timer_input(gb);
+        gb->tac_en = data & (1 << 2);
+        gb->tac_clk = data & 0x3;
+        timer_update(gb, before && !timer_input(gb));
+        break;
+    }
+    }
+}
+
+u64 timer_next_change(GameBoy* gb, u16 addr) {
+    if (addr == 0xFF04) {
+        return gb->div_epoch + ((gb->cycles - gb->div_epoch) / 256 + 1) * 256;
+    }
+    if (!gb->tac_en) {
+        return NEVER;
+    }
+    u64 p = period(gb);
+    return gb->div_epoch + ((gb->cycles - gb->div_epoch) / p + 1) * p;
+}
@@ -0,0 +1,75 @@
+#include "trace.h"
+
+#ifdef RONDO_TRACE
+
+#include "cpu.h"
+#include "stdio.h"
+#include "string.h"
+
+// Records kept, a power of two. About a second of typical code at 1 << 20.
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS (1 << 20)
+#endif
+
+static TraceRecord ring[TRACE_RECORDS];
+// Free-running count of records written
+static u64 written;
+
+// Reads without side effects, for the bytes after the opcode
+static u8 peek(GameBoy* gb, u16 addr) {
+    u8* page = gb->read_map[addr >> 8];
+    if (page) {
+        return page[addr & 0xFF];
+    }
+    if (addr >= 0xFF80) {
+        return addr == 0xFFFF ? gb->ie : gb->hram[addr - 0xFF80];
+    }
+    return 0xFF;
+}
+
+void trace_op(GameBoy* gb) {
+    TraceRecord* r = &ring[written++ & (TRACE_RECORDS - 1)];
+    r->cycles = gb->cycles;
+    r->pc = gb->pc;
+    r->sp = gb->sp;
+    r->bytes[0] = peek(gb, gb->pc);
+    r->bytes[1] = peek(gb, gb->pc + 1);
+    r->bytes[2] = peek(gb, gb->pc + 2);
+    r->a = gb->a;
+    r->f = flag_z(gb) << 7 | gb->f_n << 6 | flag_h(gb) << 5 | flag_c(gb) << 4;
+    r->b = gb->b;
+    r->c = gb->c;
+    r->d = gb->d;
+    r->e = gb->e;
+    r->h = gb->h;
+    r->l = gb->l;
+    r->flags = (gb->ime ? TRACE_IME : 0) | (gb->halt_bug ? TRACE_HALT_BUG : 0);
+}
+
+bool trace_dump(const char* filename) {
+    FILE* f = fopen(filename, "wb");
+    if (!f) {
+        return false;
+    }
+    u64 count = written < TRACE_RECORDS ? written : TRACE_RECORDS;
+    TraceHeader header = {{0}, TRACE_VERSION, sizeof(TraceRecord),
+                          (u32)count, 0};
+    memcpy(header.magic, TRACE_MAGIC, 4);
+    // Oldest first, in up to two pieces if the ring has wrapped
+    size_t start = (written - count) & (TRACE_RECORDS - 1);
+    size_t first = TRACE_RECORDS - start < count ? TRACE_RECORDS - start
+                                                  : count;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(ring + start, sizeof(TraceRecord), first, f) == first &&
+              fwrite(ring, sizeof(TraceRecord), count - first, f) ==
+                  count - first;
+    return fclose(f) == 0 && ok;
+}
+
+void trace_crash(void) {
+    if (trace_dump(TRACE_FILE)) {
+        printf("Trace of the last instructions written to %s\n", TRACE_FILE);
+    }
+}
+
+#endif
@@ -0,0 +1,41 @@
+#include "tribuf.h"
+#include "stdlib.h"
+
+#define TRIBUF_FRESH 4
+
+void init_tribuf(TripleBuffer* tb, size_t size) {
+    for (int i = 0; i < 3; i++) {
+        tb->bufs[i] = crit_alloc(size);
+    }
+    tb->back = 0;
+    atomic_init(&tb->middle, 1);
+    tb->front = 2;
+}
+
+void free_tribuf(TripleBuffer* tb) {
+    for (int i = 0; i < 3; i++) {
+        free(tb->bufs[i]);
+        tb->bufs[i] = NULL;
+    }
+}
+
+u8* tribuf_back(TripleBuffer* tb) { return tb->bufs[tb->back]; }
+
+void tribuf_publish(TripleBuffer* tb) {
+    // Release so the frame's contents are visible before its index is
+    unsigned old = atomic_exchange_explicit(
+        &tb->middle, tb->back | TRIBUF_FRESH, memory_order_acq_rel);
+    tb->back = old & ~TRIBUF_FRESH;
+}
+
+u8* tribuf_take(TripleBuffer* tb) {
+    if (!(atomic_load_explicit(&tb->middle, memory_order_relaxed) &
+          TRIBUF_FRESH)) {
+        return NULL;
+    }
+    // Only the consumer clears TRIBUF_FRESH, so it is still set here
+    unsigned old = atomic_exchange_explicit(&tb->middle, tb->front,
+                                            memory_order_acq_rel);
+    tb->front = old & ~TRIBUF_FRESH;
+    return tb->bufs[tb->front];
+}
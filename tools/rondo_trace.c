@@ -0,0 +1,69 @@
+// Turns a trace dump (see trace.h) into one line of disassembly per
+// instruction, with the cycle count and registers before it ran.
+//
+// Usage: rondo-trace [--last N] [rondo-trace.bin]
+#include "disasm.h"
+#include "trace.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+static void print_record(const TraceRecord* r) {
+    char text[32];
+    int length = disassemble(text, sizeof(text), r->pc, r->bytes);
+    char hex[12] = "";
+    for (int i = 0; i < length && i < 3; i++) {
+        snprintf(hex + 3 * i, sizeof(hex) - 3 * i, "%02X ", r->bytes[i]);
+    }
+    printf("%12llu %04X  %-9s %-16s A:%02X F:%c%c%c%c BC:%02X%02X "
+           "DE:%02X%02X HL:%02X%02X SP:%04X%s%s\n",
+           (unsigned long long)r->cycles, r->pc, hex, text, r->a,
+           r->f & 0x80 ? 'Z' : '-', r->f & 0x40 ? 'N' : '-',
+           r->f & 0x20 ? 'H' : '-', r->f & 0x10 ? 'C' : '-', r->b, r->c, r->d,
+           r->e, r->h, r->l, r->sp, r->flags & TRACE_IME ? " IME" : "",
+           r->flags & TRACE_HALT_BUG ? " HALT-BUG" : "");
+}
+
+int main(int argc, char* argv[]) {
+    const char* filename = TRACE_FILE;
+    u64 last = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--last") && i + 1 < argc) {
+            last = strtoull(argv[++i], NULL, 10);
+        } else if (argv[i][0] == '-') {
+            printf("Usage: rondo-trace [--last N] [%s]\n", TRACE_FILE);
+            return 1;
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        printf("Error: could not open %s\n", filename);
+        return 1;
+    }
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, 4) ||
+        header.version != TRACE_VERSION ||
+        header.record_size != sizeof(TraceRecord)) {
+        printf("Error: %s is not a trace dump from this build\n", filename);
+        fclose(f);
+        return 1;
+    }
+
+    u64 skip = last && last < header.count ? header.count - last : 0;
+    fseek(f, (long)(skip * sizeof(TraceRecord)), SEEK_CUR);
+    printf("%12s %-4s  %-9s %s\n", "cycles", "pc", "bytes", "instruction");
+    TraceRecord r;
+    for (u64 i = skip; i < header.count; i++) {
+        if (fread(&r, sizeof(r), 1, f) != 1) {
+            printf("Error: %s is truncated\n", filename);
+            break;
+        }
+        print_record(&r);
+    }
+    fclose(f);
+    return 0;
+}